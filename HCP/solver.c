@@ -3,12 +3,25 @@
 #include <string.h>
 #include <time.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <limits.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN 1
+#else
+#define HAVE_AVX2_SCAN 0
+#endif
 
 #define MAX_NODES 1000
 #define MAX_NEIGHBORS 1000
+#define USE_AVX2 1 // 1 scans 2-opt moves with AVX2 when the CPU supports it, 0 always uses the scalar loop.
+#define TIME_LIMIT 0 // Wall-clock seconds for the whole solve, 0 runs without a limit.
 #define FILEPATH "HCP_instances/150_hard.hcp"
 #define NAME "150_hard"
+#define LOG_LEVEL 1 // 0 prints errors only, 1 also a summary of the solve, 2 also runs and improvements at most once per LOG_INTERVAL, 3 every message and the nearest neighbor tours.
+#define LOG_INTERVAL 1.0 // Seconds between two progress lines at LOG_LEVEL 2.
+#define LOG_BUFFER 65536 // Bytes of output held before a write. Messages below LOG_LEVEL 3 flush it at once.
+#define INSTRUMENT 0 // 1 counts moves, distance lookups, allocations and restarts and times each phase, saved to HCP_results/NAME_stats.json. 0 compiles it all out.
 
 typedef struct {
     int* neighbors;
@@ -20,17 +33,143 @@ typedef struct {
     int dist;
 } TourResult;
 
+// Weights of the complete graph: 1 for an edge of the instance, 2 otherwise.
+// Only the upper triangle is stored, one byte per entry, in a cache-aligned
+// block.
+typedef struct {
+    uint8_t* triangle; // entry (a, b), a < b, at triangle_index(n, a, b)
+    int n;
+} Distances;
+
+// Finds the first j in [from, n) such that reversing tour[i + 1..j] makes the
+// tour longer, or returns n.
+typedef int (*ScanFunction)(const Distances* distances, const int* tour, int n, int i, int from);
+
+// Tour as a plain array with a position index. Instances stay below
+// MAX_NODES, where O(n) reversals are cheap, so unlike the TSP solver there is
+// no two-level list.
+typedef struct {
+    int* order; // nodes in tour order
+    int* slot; // slot[node] = index of node in order
+    int n;
+} Tour;
+
+#define LOG_SUMMARY 1
+#define LOG_PROGRESS 2
+#define LOG_DEBUG 3
+
+// Prints a message of the given level. Levels above LOG_LEVEL are compiled
+// out with their arguments, so a quiet build formats nothing in the runs.
+// Errors keep using printf and are always shown.
+#define LOG(level, ...) do { \
+    if (LOG_LEVEL >= (level) && log_due(level)) { \
+        printf(__VA_ARGS__); \
+        if ((level) < LOG_DEBUG) fflush(stdout); \
+    } \
+} while (0)
+
+double next_progress; // wall_time() before which LOG_PROGRESS messages are dropped
+
+#if INSTRUMENT
+// Phases timed by INSTRUMENT. The solver is in exactly one at any time:
+// entering a phase pauses the one it was in, so the phase times add up to the
+// whole solve.
+typedef enum {
+    PHASE_OTHER,
+    PHASE_PARSE, // reading and validating the graph
+    PHASE_PREPROCESS, // weight matrix
+    PHASE_CONSTRUCT, // nearest neighbor tours
+    PHASE_REVERSE,
+    PHASE_TWO_OPT,
+    PHASE_PERTURB, // swaps, without the 2-opt repairing them
+    PHASE_IO,
+    NUM_PHASES
+} Phase;
+
+typedef struct {
+    long long moves_evaluated; // scored 2-opt and swap moves, reverse phase included
+    long long moves_applied; // 2-opt moves, reversals and swaps made, later undone or not
+    long long distance_lookups;
+    long long allocations; // search buffers: the run arena and its tour state
+    long long restarts; // runs started
+    double seconds[NUM_PHASES];
+    Phase phase;
+    double phase_start; // 0 before the first phase
+} Stats;
+
+Stats solver_stats;
+
+#define STATS_ADD(counter, amount) (solver_stats.counter += (amount))
+#define STATS_PHASE(phase) Phase stats_outer = enter_phase(phase)
+#define STATS_SWITCH_PHASE(phase) enter_phase(phase) // to the next phase of a STATS_PHASE block
+#define STATS_END_PHASE() enter_phase(stats_outer)
+#else
+#define STATS_ADD(counter, amount) ((void)0)
+#define STATS_PHASE(phase) ((void)0)
+#define STATS_SWITCH_PHASE(phase) ((void)0)
+#define STATS_END_PHASE() ((void)0)
+#endif
+
+// Working tour of the local search.
+typedef struct {
+    Tour tour;
+    double deadline; // wall_time() at which the search stops, 0 for no limit
+    int n;
+} TourState;
+
+// Buffers reused by every run of solve_hcp, so that runs do not allocate.
+// two_opt_and_swap returns result as the tour of its TourResult; solve_hcp
+// takes it over when it is the new best tour and hands back the old one.
+typedef struct {
+    TourState state;
+    int* initial_tour; // nearest neighbor tour
+    int* worsened_tour; // output of the reverse phase
+    bool* visited; // nearest neighbor scratch
+    int* result;
+} RunArena;
+
 Node* parse_hcp(const char* filename, int* num_nodes);
 void save_tour_file(const int* tour, int num_nodes, double time);
-int** generate_distance_matrix(Node* graph, int num_nodes);
-int calculate_tour_length(const int* tour, int n, int** distances);
-TourResult two_opt_swap(int** distances, const int* initial_tour, int n);
-int* two_opt_reverse(int** distances, const int* initial_tour, int n);
-TourResult two_opt_and_swap(int** distances, const int* initial_tour, int n);
-int* nearest_neighbor(int** distances, int n, int initial_point);
+Distances generate_distance_matrix(Node* graph, int num_nodes);
+size_t triangle_index(int n, int a, int b);
+int get_distance(const Distances* distances, int a, int b);
+int calculate_tour_length(const int* tour, int n, const Distances* distances);
+double wall_time();
+bool out_of_time(double deadline);
+bool log_due(int level);
+#if INSTRUMENT
+Phase enter_phase(Phase phase);
+void write_stats_entry(FILE* file, const char* role, const Stats* stats);
+void save_stats(int num_nodes, int dist);
+#endif
+void tour_layout(Tour* t, const int* nodes);
+void tour_init(Tour* t, const int* nodes, int n);
+void tour_free(Tour* t);
+int tour_next(const Tour* t, int node);
+int tour_prev(const Tour* t, int node);
+void tour_swap(Tour* t, int u, int v);
+void tour_to_array(const Tour* t, int* out);
+void init_tour_state(TourState* state, const int* tour, int n);
+void reset_tour_state(TourState* state, const int* tour);
+void free_tour_state(TourState* state);
+void init_run_arena(RunArena* arena, int n);
+void free_run_arena(RunArena* arena);
+int swap_delta(const Distances* distances, const Tour* tour, int u, int v);
+int shorter_scan(const Distances* distances, Node* graph, const Tour* tour, int i, int from);
+int two_opt_local(const Distances* distances, Node* graph, TourState* state, int dist);
+TourResult two_opt_swap(const Distances* distances, Node* graph, RunArena* arena, const int* initial_tour, int n);
+int longer_scan_scalar(const Distances* distances, const int* tour, int n, int i, int from);
+#if HAVE_AVX2_SCAN
+__m256i gather_distances(const Distances* distances, __m256i x, __m256i y);
+int longer_scan_avx2(const Distances* distances, const int* tour, int n, int i, int from);
+#endif
+ScanFunction select_scan(int n);
+void two_opt_reverse(const Distances* distances, const int* initial_tour, int* tour, int n);
+TourResult two_opt_and_swap(const Distances* distances, Node* graph, RunArena* arena, const int* initial_tour, int n, double deadline);
+int* nearest_neighbor(const Distances* distances, RunArena* arena, int n, int initial_point);
 bool validate_graph(Node* graph, int num_nodes);
 void free_graph(Node* graph, int num_nodes);
-void free_distances(int** distances, int num_nodes);
+void free_distances(Distances* distances);
 void print_graph(Node* graph, int num_nodes);
 
 Node* parse_hcp(const char* filename, int* num_nodes) {
@@ -119,142 +258,386 @@ void save_tour_file(const int* tour, int num_nodes, double time) {
     for (int i = 0; i < num_nodes; i++) fprintf(f, "%d\n", tour[i] + 1);
     fprintf(f, "-1\nEOF\n");
     fclose(f);
-    printf("Tour saved to %s\n", filepath);
+    LOG(LOG_SUMMARY, "Tour saved to %s\n", filepath);
 }
 
-int** generate_distance_matrix(Node* graph, int num_nodes) {
-    int** distances = malloc(num_nodes * sizeof(int*));
-    for (int i = 0; i < num_nodes; i++) {
-        distances[i] = malloc(num_nodes * sizeof(int));
-    }
-
+Distances generate_distance_matrix(Node* graph, int num_nodes) {
+    size_t count = (size_t)num_nodes * (num_nodes - 1) / 2;
+    size_t bytes = (count + sizeof(int32_t) + 63) / 64 * 64; // room for 4-byte gathers at the last entry
+    Distances distances = {aligned_alloc(64, bytes > 0 ? bytes : 64), num_nodes};
+    memset(distances.triangle, 2, count);
     for (int i = 0; i < num_nodes; i++) {
-        for (int j = 0; j < num_nodes; j++) {
-            if (i == j) {
-                distances[i][j] = 0;
-                continue;
-            }
-            bool adjacent = false;
-            for (int k = 0; k < graph[i].num_neighbors; k++) {
-                if (graph[i].neighbors[k] == j) {
-                    adjacent = true;
-                    break;
-                }
-            }
-            distances[i][j] = adjacent ? 1 : 2;
+        for (int k = 0; k < graph[i].num_neighbors; k++) {
+            int j = graph[i].neighbors[k];
+            if (j != i) distances.triangle[triangle_index(num_nodes, i < j ? i : j, i < j ? j : i)] = 1;
         }
     }
     return distances;
 }
 
-int calculate_tour_length(const int* tour, int n, int** distances) {
+// Position of (a, b), a < b, in a row-major upper triangle without diagonal.
+size_t triangle_index(int n, int a, int b) {
+    return (size_t)a * (2 * (size_t)n - a - 1) / 2 + (b - a - 1);
+}
+
+int get_distance(const Distances* distances, int a, int b) {
+    STATS_ADD(distance_lookups, 1);
+    if (a == b) return 0;
+    if (a > b) {
+        int temp = a;
+        a = b;
+        b = temp;
+    }
+    return distances->triangle[triangle_index(distances->n, a, b)];
+}
+
+int calculate_tour_length(const int* tour, int n, const Distances* distances) {
     int length = 0;
     for (int i = 0; i < n; i++) {
         int current = tour[i];
         int next = tour[(i + 1) % n];
-        length += distances[current][next];
+        length += get_distance(distances, current, next);
     }
     return length;
 }
 
-TourResult two_opt_swap(int** distances, const int* initial_tour, int n) {
-    int* best_tour = malloc(n * sizeof(int));
-    memcpy(best_tour, initial_tour, n * sizeof(int));
-    int shortest_dist = calculate_tour_length(best_tour, n, distances);
-    bool improved = true;
+// Seconds on a monotonic wall clock. clock() measures CPU time, which is not
+// what a job's time slot is counted in.
+double wall_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
 
-    while (improved) {
+bool out_of_time(double deadline) {
+    return deadline > 0 && wall_time() >= deadline;
+}
+
+// At LOG_LEVEL 2, lets one progress message through per LOG_INTERVAL and
+// drops the others.
+bool log_due(int level) {
+    if (level != LOG_PROGRESS || LOG_LEVEL > LOG_PROGRESS) return true;
+    double now = wall_time();
+    if (now < next_progress) return false;
+    next_progress = now + LOG_INTERVAL;
+    return true;
+}
+
+#if INSTRUMENT
+// Charges the time since the last switch to the current phase and moves to
+// phase. Returns the phase left, for STATS_END_PHASE.
+Phase enter_phase(Phase phase) {
+    double now = wall_time();
+    Phase previous = solver_stats.phase;
+    if (solver_stats.phase_start > 0) solver_stats.seconds[previous] += now - solver_stats.phase_start;
+    solver_stats.phase = phase;
+    solver_stats.phase_start = now;
+    return previous;
+}
+
+void write_stats_entry(FILE* file, const char* role, const Stats* stats) {
+    static const char* phase_names[NUM_PHASES] = {"other", "parse", "preprocess", "construct", "reverse", "two_opt", "perturbation", "io"};
+    fprintf(file, "{\"role\": \"%s\", \"moves_evaluated\": %lld, \"moves_applied\": %lld, \"distance_lookups\": %lld, \"allocations\": %lld, \"restarts\": %lld, \"seconds\": {",
+            role, stats->moves_evaluated, stats->moves_applied, stats->distance_lookups, stats->allocations, stats->restarts);
+    for (int p = 0; p < NUM_PHASES; p++) fprintf(file, "%s\"%s\": %.6f", p > 0 ? ", " : "", phase_names[p], stats->seconds[p]);
+    fprintf(file, "}}");
+}
+
+// Same layout as the TSP solver's file; the solver runs on one thread, so
+// the total and its only thread are the same.
+void save_stats(int num_nodes, int dist) {
+    enter_phase(solver_stats.phase);
+    double time = 0;
+    for (int p = 0; p < NUM_PHASES; p++) time += solver_stats.seconds[p];
+
+    char filepath[256];
+    snprintf(filepath, sizeof(filepath), "HCP_results/%s_stats.json", NAME);
+    FILE* file = fopen(filepath, "w");
+    if (!file) {
+        printf("Error: Unable to create file %s\n", filepath);
+        return;
+    }
+    fprintf(file, "{\"solver\": \"HCP\", \"name\": \"%s\", \"nodes\": %d, \"dist\": %d, \"seconds\": %.6f,\n\"total\": ", NAME, num_nodes, dist, time);
+    write_stats_entry(file, "total", &solver_stats);
+    fprintf(file, ",\n\"threads\": [\n  ");
+    write_stats_entry(file, "main", &solver_stats);
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    LOG(LOG_SUMMARY, "Stats saved in %s\n", filepath);
+}
+#endif
+
+void tour_layout(Tour* t, const int* nodes) {
+    if (nodes != t->order) memcpy(t->order, nodes, t->n * sizeof(int));
+    for (int i = 0; i < t->n; i++) t->slot[t->order[i]] = i;
+}
+
+void tour_init(Tour* t, const int* nodes, int n) {
+    t->n = n;
+    t->order = malloc(n * sizeof(int));
+    t->slot = malloc(n * sizeof(int));
+    STATS_ADD(allocations, 2);
+    tour_layout(t, nodes);
+}
+
+void tour_free(Tour* t) {
+    free(t->order);
+    free(t->slot);
+}
+
+int tour_next(const Tour* t, int node) {
+    int i = t->slot[node] + 1;
+    return t->order[i < t->n ? i : 0];
+}
+
+int tour_prev(const Tour* t, int node) {
+    int i = t->slot[node];
+    return t->order[i > 0 ? i - 1 : t->n - 1];
+}
+
+// Exchanges the places of nodes u and v.
+void tour_swap(Tour* t, int u, int v) {
+    int slot_u = t->slot[u];
+    t->order[t->slot[v]] = u;
+    t->order[slot_u] = v;
+    t->slot[u] = t->slot[v];
+    t->slot[v] = slot_u;
+}
+
+void tour_to_array(const Tour* t, int* out) {
+    memcpy(out, t->order, t->n * sizeof(int));
+}
+
+void init_tour_state(TourState* state, const int* tour, int n) {
+    state->n = n;
+    tour_init(&state->tour, tour, n);
+    state->deadline = 0;
+}
+
+// Starts a new search on tour with the buffers of a previous one.
+void reset_tour_state(TourState* state, const int* tour) {
+    tour_layout(&state->tour, tour);
+    state->deadline = 0;
+}
+
+void free_tour_state(TourState* state) {
+    tour_free(&state->tour);
+}
+
+void init_run_arena(RunArena* arena, int n) {
+    arena->initial_tour = malloc(n * sizeof(int));
+    arena->worsened_tour = malloc(n * sizeof(int));
+    arena->visited = malloc(n * sizeof(bool));
+    arena->result = malloc(n * sizeof(int));
+    STATS_ADD(allocations, 4);
+    for (int i = 0; i < n; i++) arena->initial_tour[i] = i;
+    init_tour_state(&arena->state, arena->initial_tour, n);
+}
+
+void free_run_arena(RunArena* arena) {
+    free_tour_state(&arena->state);
+    free(arena->initial_tour);
+    free(arena->worsened_tour);
+    free(arena->visited);
+    free(arena->result);
+}
+
+// Change in tour length from exchanging the places of nodes u and v.
+int swap_delta(const Distances* distances, const Tour* tour, int u, int v) {
+    STATS_ADD(moves_evaluated, 1);
+    int prev_u = tour_prev(tour, u), next_u = tour_next(tour, u);
+    int prev_v = tour_prev(tour, v), next_v = tour_next(tour, v);
+    if (next_u == v || next_v == u) {
+        int p = next_u == v ? prev_u : prev_v, first = next_u == v ? u : v;
+        int second = next_u == v ? v : u, q = next_u == v ? next_v : next_u;
+        if (p == second) return 0;
+        return get_distance(distances, p, second) + get_distance(distances, first, q)
+             - get_distance(distances, p, first) - get_distance(distances, second, q);
+    }
+    return get_distance(distances, prev_u, v) + get_distance(distances, v, next_u)
+         + get_distance(distances, prev_v, u) + get_distance(distances, u, next_v)
+         - get_distance(distances, prev_u, u) - get_distance(distances, u, next_u)
+         - get_distance(distances, prev_v, v) - get_distance(distances, v, next_v);
+}
+
+// Smallest j >= from, with j > i + 1, whose 2-opt move between tour edges i
+// and j shortens the tour, or n. Weights are 1 or 2, so such a move adds a
+// graph edge (a, c) or (b, d) and only the neighbors of a and b are looked at.
+// It is the move a scan over every j would find first.
+int shorter_scan(const Distances* distances, Node* graph, const Tour* tour, int i, int from) {
+    int n = tour->n;
+    const int* order = tour->order;
+    int a = order[i], b = order[i + 1];
+    int ab = get_distance(distances, a, b);
+    int first = n;
+    for (int side = 0; side < 2; side++) {
+        int u = side == 0 ? a : b;
+        for (int k = 0; k < graph[u].num_neighbors; k++) {
+            int slot = tour->slot[graph[u].neighbors[k]];
+            int j = side == 0 ? slot : (slot - 1 + n) % n; // c, or the node before d
+            if (j < from || j >= first) continue;
+            int c = order[j], d = order[(j + 1) % n];
+            STATS_ADD(moves_evaluated, 1);
+            if (get_distance(distances, a, c) + get_distance(distances, b, d) - ab - get_distance(distances, c, d) < 0) first = j;
+        }
+    }
+    return first;
+}
+
+// First-improvement 2-opt in the order of full passes over tour positions,
+// repeated until a pass finds nothing.
+// Returns the new tour length and stops early once it reaches n.
+int two_opt_local(const Distances* distances, Node* graph, TourState* state, int dist) {
+    Tour* tour = &state->tour;
+    int* order = tour->order;
+    int n = state->n;
+    bool improved = dist > n;
+    STATS_PHASE(PHASE_TWO_OPT);
+
+    while (improved && !out_of_time(state->deadline)) {
         improved = false;
         for (int i = 0; i < n - 1; i++) {
-            for (int j = i + 2; j < n; j++) {
-                int a = best_tour[i], b = best_tour[(i + 1) % n];
-                int c = best_tour[j], d = best_tour[(j + 1) % n];
-                int current_dist = distances[a][b] + distances[c][d];
-                int new_dist = distances[a][c] + distances[b][d];
-                if (new_dist < current_dist) {
-                    int delta = new_dist - current_dist;
-                    if (delta < 0) {
-                        for (int k = 0; k < (j - i) / 2; k++) {
-                            int temp = best_tour[i + 1 + k];
-                            best_tour[i + 1 + k] = best_tour[j - k];
-                            best_tour[j - k] = temp;
-                        }
-                        shortest_dist += delta;
-                        improved = true;
-                        if (shortest_dist == n) goto end;
-                    }
+            for (int j = shorter_scan(distances, graph, tour, i, i + 2); j < n; j = shorter_scan(distances, graph, tour, i, j + 1)) {
+                int a = order[i], b = order[i + 1], c = order[j], d = order[(j + 1) % n];
+                dist += get_distance(distances, a, c) + get_distance(distances, b, d)
+                      - get_distance(distances, a, b) - get_distance(distances, c, d);
+                for (int k = 0; k < (j - i) / 2; k++) {
+                    int temp = order[i + 1 + k];
+                    order[i + 1 + k] = order[j - k];
+                    order[j - k] = temp;
+                    tour->slot[order[i + 1 + k]] = i + 1 + k;
+                    tour->slot[order[j - k]] = j - k;
                 }
+                STATS_ADD(moves_applied, 1);
+                improved = true;
+                if (dist == n) goto end;
             }
         }
     }
 end:
-    TourResult result = {best_tour, shortest_dist};
+    STATS_END_PHASE();
+    return dist;
+}
+
+TourResult two_opt_swap(const Distances* distances, Node* graph, RunArena* arena, const int* initial_tour, int n) {
+    TourState* state = &arena->state;
+    reset_tour_state(state, initial_tour);
+    int shortest_dist = two_opt_local(distances, graph, state, calculate_tour_length(initial_tour, n, distances));
+
+    TourResult result = {arena->result, shortest_dist};
+    tour_to_array(&state->tour, result.tour);
     return result;
 }
 
-int* two_opt_reverse(int** distances, const int* initial_tour, int n) {
-    int* best_tour = malloc(n * sizeof(int));
+int longer_scan_scalar(const Distances* distances, const int* tour, int n, int i, int from) {
+    int a = tour[i], b = tour[i + 1];
+    int ab = get_distance(distances, a, b);
+    for (int j = from; j < n; j++) {
+        int c = tour[j], d = tour[(j + 1) % n];
+        STATS_ADD(moves_evaluated, 1);
+        if (get_distance(distances, a, c) + get_distance(distances, b, d) - ab - get_distance(distances, c, d) > 0) return j;
+    }
+    return n;
+}
+
+#if HAVE_AVX2_SCAN
+// Weights between x[k] and y[k], x[k] != y[k], for 8 pairs at once. Each
+// gather reads 4 bytes and keeps the low one.
+__attribute__((target("avx2")))
+__m256i gather_distances(const Distances* distances, __m256i x, __m256i y) {
+    __m256i lo = _mm256_min_epi32(x, y), hi = _mm256_max_epi32(x, y);
+    __m256i row = _mm256_srli_epi32(_mm256_mullo_epi32(lo, _mm256_sub_epi32(_mm256_set1_epi32(2 * distances->n - 1), lo)), 1);
+    __m256i index = _mm256_add_epi32(row, _mm256_sub_epi32(hi, _mm256_add_epi32(lo, _mm256_set1_epi32(1))));
+    __m256i words = _mm256_i32gather_epi32((const int*)distances->triangle, index, 1);
+    return _mm256_and_si256(words, _mm256_set1_epi32(0xFF));
+}
+
+__attribute__((target("avx2")))
+int longer_scan_avx2(const Distances* distances, const int* tour, int n, int i, int from) {
+    int a = tour[i], b = tour[i + 1];
+    __m256i va = _mm256_set1_epi32(a), vb = _mm256_set1_epi32(b);
+    __m256i ab = _mm256_set1_epi32(get_distance(distances, a, b));
+    int j = from;
+    for (; j + 8 < n; j += 8) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)&tour[j]);
+        __m256i d = _mm256_loadu_si256((const __m256i*)&tour[j + 1]);
+        __m256i added = _mm256_add_epi32(gather_distances(distances, va, c), gather_distances(distances, vb, d));
+        __m256i removed = _mm256_add_epi32(ab, gather_distances(distances, c, d));
+        __m256i longer = _mm256_cmpgt_epi32(_mm256_sub_epi32(added, removed), _mm256_setzero_si256());
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(longer));
+        STATS_ADD(moves_evaluated, 8);
+        STATS_ADD(distance_lookups, 24);
+        if (mask) return j + __builtin_ctz(mask);
+    }
+    return longer_scan_scalar(distances, tour, n, i, j);
+}
+#endif
+
+ScanFunction select_scan(int n) {
+#if HAVE_AVX2_SCAN
+    if (USE_AVX2 && n <= 46340 && __builtin_cpu_supports("avx2")) return longer_scan_avx2;
+#endif
+    return longer_scan_scalar;
+}
+
+// Lengthens the tour with 2-opt moves, each scored from the two edges it
+// changes. The lengthened copy of initial_tour is written into tour.
+void two_opt_reverse(const Distances* distances, const int* initial_tour, int* tour, int n) {
+    int* best_tour = tour;
     memcpy(best_tour, initial_tour, n * sizeof(int));
-    int longest_dist = calculate_tour_length(best_tour, n, distances);
+    ScanFunction scan = select_scan(n);
     bool improved = true;
 
     while (improved) {
         improved = false;
         for (int i = 0; i < n - 1; i++) {
-            for (int j = i + 2; j < n; j++) {
-                int* temp_tour = malloc(n * sizeof(int));
-                memcpy(temp_tour, best_tour, n * sizeof(int));
+            for (int j = scan(distances, best_tour, n, i, i + 2); j < n; j = scan(distances, best_tour, n, i, j + 1)) {
                 for (int k = 0; k < (j - i) / 2; k++) {
-                    int temp = temp_tour[i + 1 + k];
-                    temp_tour[i + 1 + k] = temp_tour[j - k];
-                    temp_tour[j - k] = temp;
-                }
-                int new_dist = calculate_tour_length(temp_tour, n, distances);
-                if (new_dist > longest_dist) {
-                    free(best_tour);
-                    best_tour = temp_tour;
-                    longest_dist = new_dist;
-                    improved = true;
-                } else {
-                    free(temp_tour);
+                    int temp = best_tour[i + 1 + k];
+                    best_tour[i + 1 + k] = best_tour[j - k];
+                    best_tour[j - k] = temp;
                 }
+                STATS_ADD(moves_applied, 1);
+                improved = true;
             }
         }
     }
-    return best_tour;
 }
 
 // For decision problems (NP-complete) generating a new local minimum from a pertubed local minimum have better results.
-TourResult two_opt_and_swap(int** distances, const int* initial_tour, int n) {
-    int* worsened_tour = two_opt_reverse(distances, initial_tour, n);
-    TourResult best = two_opt_swap(distances, worsened_tour, n);
-    free(worsened_tour);
-    int* best_tour = best.tour;
-    int shortest_dist = best.dist;
-    int* current_tour = malloc(n * sizeof(int));
-    memcpy(current_tour, best_tour, n * sizeof(int));
-    bool improved = true;
+// The working tour always keeps the last swap of positions i and j.
+TourResult two_opt_and_swap(const Distances* distances, Node* graph, RunArena* arena, const int* initial_tour, int n, double deadline) {
+    int* worsened_tour = arena->worsened_tour;
+    STATS_PHASE(PHASE_REVERSE);
+    two_opt_reverse(distances, initial_tour, worsened_tour, n);
+    STATS_SWITCH_PHASE(PHASE_PERTURB);
+    TourState* state = &arena->state;
+    reset_tour_state(state, worsened_tour);
+    state->deadline = deadline;
+    int current_dist = two_opt_local(distances, graph, state, calculate_tour_length(worsened_tour, n, distances));
+    int* best_tour = arena->result;
+    tour_to_array(&state->tour, best_tour);
+    int shortest_dist = current_dist;
+    bool improved = shortest_dist > n;
 
     while (improved) {
         improved = false;
         for (int i = 0; i < n - 1; i++) {
+            if (out_of_time(deadline)) break;
             for (int j = 0; j < n; j++) {
                 if (i != j) {
-                    int temp = current_tour[i];
-                    current_tour[i] = current_tour[j];
-                    current_tour[j] = temp;
-                    TourResult temp_result = two_opt_swap(distances, current_tour, n);
-                    memcpy(current_tour, temp_result.tour, n * sizeof(int));
-                    if (temp_result.dist < shortest_dist) {
-                        free(best_tour);
-                        best_tour = temp_result.tour;
-                        shortest_dist = temp_result.dist;
+                    int u = state->tour.order[i], v = state->tour.order[j];
+                    current_dist += swap_delta(distances, &state->tour, u, v);
+                    tour_swap(&state->tour, u, v);
+                    STATS_ADD(moves_applied, 1);
+                    current_dist = two_opt_local(distances, graph, state, current_dist);
+                    if (current_dist < shortest_dist) {
+                        tour_to_array(&state->tour, best_tour);
+                        shortest_dist = current_dist;
                         improved = true;
-                        printf("2-opt improvement: %d\n", shortest_dist);
+                        LOG(LOG_PROGRESS, "2-opt improvement: %d\n", shortest_dist);
                         if (shortest_dist == n) goto end;
                         break;
-                    } else {
-                        free(temp_result.tour);
                     }
                 }
             }
@@ -262,14 +645,16 @@ TourResult two_opt_and_swap(int** distances, const int* initial_tour, int n) {
         }
     }
 end:
-    free(current_tour);
+    STATS_END_PHASE();
     TourResult result = {best_tour, shortest_dist};
     return result;
 }
 
-int* nearest_neighbor(int** distances, int n, int initial_point) {
-    int* tour = malloc(n * sizeof(int));
-    bool* visited = calloc(n, sizeof(bool));
+// Returns the initial_tour buffer of the arena.
+int* nearest_neighbor(const Distances* distances, RunArena* arena, int n, int initial_point) {
+    int* tour = arena->initial_tour;
+    bool* visited = arena->visited;
+    memset(visited, 0, n * sizeof(bool));
     int tour_size = 0;
 
     tour[tour_size++] = 0;
@@ -283,7 +668,7 @@ int* nearest_neighbor(int** distances, int n, int initial_point) {
     while (tour_size < n) {
         bool added = false;
         for (int j = 0; j < n; j++) {
-            if (!visited[j] && distances[last_element][j] == 1) {
+            if (!visited[j] && get_distance(distances, last_element, j) == 1) {
                 tour[tour_size++] = j;
                 visited[j] = true;
                 last_element = j;
@@ -303,14 +688,14 @@ int* nearest_neighbor(int** distances, int n, int initial_point) {
         }
     }
 
-    printf("[");
-    for (int i = 0; i < n; i++) {
-        printf("%d", tour[i]);
-        if (i < n - 1) printf(", ");
+    if (LOG_LEVEL >= LOG_DEBUG) {
+        printf("[");
+        for (int i = 0; i < n; i++) {
+            printf("%d", tour[i]);
+            if (i < n - 1) printf(", ");
+        }
+        printf("]\n");
     }
-    printf("]\n");
-
-    free(visited);
     return tour;
 }
 
@@ -340,7 +725,7 @@ bool validate_graph(Node* graph, int num_nodes) {
             }
         }
     }
-    printf("Graph looks valid.\n");
+    LOG(LOG_SUMMARY, "Graph looks valid.\n");
     return true;
 }
 
@@ -351,9 +736,9 @@ void free_graph(Node* graph, int num_nodes) {
     free(graph);
 }
 
-void free_distances(int** distances, int num_nodes) {
-    for (int i = 0; i < num_nodes; i++) free(distances[i]);
-    free(distances);
+void free_distances(Distances* distances) {
+    free(distances->triangle);
+    distances->triangle = NULL;
 }
 
 void print_graph(Node* graph, int num_nodes) {
@@ -370,47 +755,59 @@ void print_graph(Node* graph, int num_nodes) {
     printf("}\n");
 }
 
+// Restarts from every node until a Hamiltonian cycle is found or TIME_LIMIT
+// seconds have passed, and returns the best tour so far.
 TourResult solve_hcp(Node* graph, int num_nodes) {
-    clock_t start = clock();
-    int** distances = generate_distance_matrix(graph, num_nodes);
+    double start = wall_time();
+    double deadline = TIME_LIMIT > 0 ? start + TIME_LIMIT : 0;
+    STATS_PHASE(PHASE_PREPROCESS);
+    Distances distances = generate_distance_matrix(graph, num_nodes);
+    STATS_SWITCH_PHASE(PHASE_OTHER);
     int initial_point = 1;
+    RunArena arena;
+    init_run_arena(&arena, num_nodes);
 
-    int* best_tour = NULL;
+    int* best_tour = malloc(num_nodes * sizeof(int)); // swapped with run results, see RunArena
     int shortest_dist = INT_MAX;
 
-    while (initial_point < num_nodes) {
-        printf("Runs: %d, time: %.2f\n", initial_point, (double)(clock() - start) / CLOCKS_PER_SEC);
+    while (initial_point < num_nodes && (shortest_dist == INT_MAX || !out_of_time(deadline))) {
+        LOG(LOG_PROGRESS, "Runs: %d, time: %.2f\n", initial_point, wall_time() - start);
 
-        int* initial_tour = nearest_neighbor(distances, num_nodes, initial_point);
-        TourResult result = two_opt_and_swap(distances, initial_tour, num_nodes);
+        STATS_ADD(restarts, 1);
+        STATS_SWITCH_PHASE(PHASE_CONSTRUCT);
+        int* initial_tour = nearest_neighbor(&distances, &arena, num_nodes, initial_point);
+        STATS_SWITCH_PHASE(PHASE_OTHER);
+        TourResult result = two_opt_and_swap(&distances, graph, &arena, initial_tour, num_nodes, deadline);
 
-        free(initial_tour);
         if (result.dist < shortest_dist) {
-            if (best_tour) free(best_tour);
+            arena.result = best_tour;
             best_tour = result.tour;
             shortest_dist = result.dist;
             if (shortest_dist == num_nodes) break;
-        } else {
-            free(result.tour);
         }
 
         initial_point++;
     }
 
-    printf("Saving result...\n");
-    save_tour_file(best_tour, num_nodes, (double)(clock() - start) / CLOCKS_PER_SEC);
-    printf("Saved.\n");
+    LOG(LOG_SUMMARY, "Saving result...\n");
+    STATS_SWITCH_PHASE(PHASE_IO);
+    save_tour_file(best_tour, num_nodes, wall_time() - start);
+    STATS_END_PHASE();
+    LOG(LOG_SUMMARY, "Saved.\n");
 
-    printf("Total time: %.2f seconds\n", (double)(clock() - start) / CLOCKS_PER_SEC);
+    LOG(LOG_SUMMARY, "Total time: %.2f seconds\n", wall_time() - start);
 
-    free_distances(distances, num_nodes);
+    free_distances(&distances);
+    free_run_arena(&arena);
     TourResult result = {best_tour, shortest_dist};
     return result;
 
 }
 
 int main() {
+    setvbuf(stdout, NULL, _IOFBF, LOG_BUFFER);
     int num_nodes;
+    STATS_PHASE(PHASE_PARSE);
     Node* graph = parse_hcp(FILEPATH, &num_nodes);
     if (!graph) {
         printf("Failed to parse HCP file.\n");
@@ -421,13 +818,17 @@ int main() {
         free_graph(graph, num_nodes);
         return 1;
     }
+    STATS_END_PHASE();
 
     TourResult result = solve_hcp(graph, num_nodes);
     int* tour = result.tour;
     int dist = result.dist;
 
-    printf("best dist: %d\n", dist);
-    printf("min dist: %d\n", num_nodes);
+    LOG(LOG_SUMMARY, "best dist: %d\n", dist);
+    LOG(LOG_SUMMARY, "min dist: %d\n", num_nodes);
+#if INSTRUMENT
+    save_stats(num_nodes, dist);
+#endif
 
     free(tour);
     free_graph(graph, num_nodes);
@@ -9,9 +9,14 @@
 #define N 9 // Size of sudoku NxN
 #define SQRT_N 3 // Square root of N
 #define MAX_RUNS 250
+#define TIME_LIMIT 0 // Wall-clock seconds for the whole solve, 0 runs without a limit.
 #define MIN_COST (N * N * 3) // each row, column and block should have cost N 
 #define FILEPATH "Sudoku_instances/march_22_2025.txt"
 #define NAME "march_22_2025"
+#define LOG_LEVEL 1 // 0 prints errors only, 1 also a summary of the solve, 2 also runs and improvements at most once per LOG_INTERVAL, 3 every message and the tours.
+#define LOG_INTERVAL 1.0 // Seconds between two progress lines at LOG_LEVEL 2.
+#define LOG_BUFFER 65536 // Bytes of output held before a write. Messages below LOG_LEVEL 3 flush it at once.
+#define INSTRUMENT 0 // 1 counts moves, cost evaluations and restarts and times each phase, saved to Sudoku_results/NAME_stats.json. 0 compiles it all out.
 
 typedef struct {
     int row;
@@ -29,10 +34,70 @@ typedef struct {
     Subgraph blocks[N];
 } Subgraphs;
 
+#define LOG_SUMMARY 1
+#define LOG_PROGRESS 2
+#define LOG_DEBUG 3
+
+// Prints a message of the given level. Levels above LOG_LEVEL are compiled
+// out with their arguments, so a quiet build formats nothing in the runs.
+// Errors keep using printf and are always shown.
+#define LOG(level, ...) do { \
+    if (LOG_LEVEL >= (level) && log_due(level)) { \
+        printf(__VA_ARGS__); \
+        if ((level) < LOG_DEBUG) fflush(stdout); \
+    } \
+} while (0)
+
+#if INSTRUMENT
+// Phases timed by INSTRUMENT. The solver is in exactly one at any time:
+// entering a phase pauses the one it was in, so the phase times add up to the
+// whole solve.
+typedef enum {
+    PHASE_OTHER,
+    PHASE_PARSE,
+    PHASE_PREPROCESS, // cell matrix, subgraphs and validation
+    PHASE_CONSTRUCT, // greedy tours
+    PHASE_REVERSE,
+    PHASE_TWO_OPT,
+    PHASE_PERTURB, // swaps, without the 2-opt repairing them
+    PHASE_IO,
+    NUM_PHASES
+} Phase;
+
+// Same counters as the TSP and HCP solvers. A cost evaluation is the
+// distance lookup of a sudoku, and nothing is allocated, so allocations
+// stays 0.
+typedef struct {
+    long long moves_evaluated; // swaps scored, reverse phase included
+    long long moves_applied; // swaps kept
+    long long distance_lookups; // calculate_global_cost calls
+    long long allocations;
+    long long restarts; // runs started
+    double seconds[NUM_PHASES];
+    Phase phase;
+    double phase_start; // 0 before the first phase
+} Stats;
+
+Stats solver_stats;
+
+#define STATS_ADD(counter, amount) (solver_stats.counter += (amount))
+#define STATS_PHASE(phase) Phase stats_outer = enter_phase(phase)
+#define STATS_SWITCH_PHASE(phase) enter_phase(phase) // to the next phase of a STATS_PHASE block
+#define STATS_END_PHASE() enter_phase(stats_outer)
+#else
+#define STATS_ADD(counter, amount) ((void)0)
+#define STATS_PHASE(phase) ((void)0)
+#define STATS_SWITCH_PHASE(phase) ((void)0)
+#define STATS_END_PHASE() ((void)0)
+#endif
+
 int sudoku[N][N];
 int cell_matrix[N][N];
 int numbers[N];
 int tour[N][N];
+int lowest_cost_tour[N][N]; // best tour of all runs, the one that gets saved
+double deadline; // wall_time() at which the search stops, 0 for no limit
+double next_progress; // wall_time() before which LOG_PROGRESS messages are dropped
 Subgraphs subgraphs;
 
 void parse_sudoku_file(const char *file_path);
@@ -41,6 +106,14 @@ void generate_cell_matrix();
 void generate_subgraphs();
 bool validate_sudoku();
 int calculate_global_cost(int tour[N][N]);
+double wall_time();
+bool out_of_time();
+bool log_due(int level);
+#if INSTRUMENT
+Phase enter_phase(Phase phase);
+void write_stats_entry(FILE *file, const char *role, const Stats *stats);
+void save_stats(int cost);
+#endif
 void generate_greedy_tour(Cell specific_cell, int specific_number);
 void two_opt(int tour[N][N], Cell *cells, int n, int *global_cost);
 void two_opt_reverse(int tour[N][N], Cell *cells, int n);
@@ -79,13 +152,13 @@ void save_sudoku_file(double time) {
     for (int r = 0; r < N; r++) {
         for (int c = 0; c < subgraphs.rows[r].size; c++) {
             Cell cell = subgraphs.rows[r].cells[c];
-            fprintf(file, "%d ", tour[cell.row][cell.col]);
+            fprintf(file, "%d ", lowest_cost_tour[cell.row][cell.col]);
         }
         fprintf(file, "\n");
     }
     fprintf(file, "\ntotal time %.2f seconds", time);
     fclose(file);
-    printf("Result saved in %s\n", filepath);
+    LOG(LOG_SUMMARY, "Result saved in %s\n", filepath);
 }
 
 void generate_cell_matrix() {
@@ -142,16 +215,18 @@ bool validate_sudoku() {
                     used[val]++;
                 }
             }
-            printf("{");
-            bool first = true;
-            for (int num = 1; num <= N; num++) {
-                if (used[num] > 0) {
-                    if (!first) printf(", ");
-                    printf("%d: %d", num, used[num]);
-                    first = false;
+            if (LOG_LEVEL >= LOG_DEBUG) {
+                printf("{");
+                bool first = true;
+                for (int num = 1; num <= N; num++) {
+                    if (used[num] > 0) {
+                        if (!first) printf(", ");
+                        printf("%d: %d", num, used[num]);
+                        first = false;
+                    }
                 }
+                printf("}\n");
             }
-            printf("}\n");
             for (int num = 1; num <= N; num++) {
                 if (used[num] > 1) {
                     printf("Invalid sudoku\n");
@@ -160,12 +235,13 @@ bool validate_sudoku() {
             }
         }
     }
-    printf("Sudoku seems valid.\n");
+    LOG(LOG_SUMMARY, "Sudoku seems valid.\n");
     return true;
 }
 
 int calculate_global_cost(int tour[N][N]) {
     int global_cost = 0;
+    STATS_ADD(distance_lookups, 1);
 
     for (int s = 0; s < 3; s++) {
         Subgraph *structs = (s == 0) ? subgraphs.rows : (s == 1) ? subgraphs.columns : subgraphs.blocks;
@@ -186,6 +262,72 @@ int calculate_global_cost(int tour[N][N]) {
     return global_cost;
 }
 
+// Seconds on a monotonic clock, so TIME_LIMIT counts real time and not CPU time.
+double wall_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+bool out_of_time() {
+    return deadline > 0 && wall_time() >= deadline;
+}
+
+// At LOG_LEVEL 2, lets one progress message through per LOG_INTERVAL and
+// drops the others.
+bool log_due(int level) {
+    if (level != LOG_PROGRESS || LOG_LEVEL > LOG_PROGRESS) return true;
+    double now = wall_time();
+    if (now < next_progress) return false;
+    next_progress = now + LOG_INTERVAL;
+    return true;
+}
+
+#if INSTRUMENT
+// Charges the time since the last switch to the current phase and moves to
+// phase. Returns the phase left, for STATS_END_PHASE.
+Phase enter_phase(Phase phase) {
+    double now = wall_time();
+    Phase previous = solver_stats.phase;
+    if (solver_stats.phase_start > 0) solver_stats.seconds[previous] += now - solver_stats.phase_start;
+    solver_stats.phase = phase;
+    solver_stats.phase_start = now;
+    return previous;
+}
+
+void write_stats_entry(FILE *file, const char *role, const Stats *stats) {
+    static const char *phase_names[NUM_PHASES] = {"other", "parse", "preprocess", "construct", "reverse", "two_opt", "perturbation", "io"};
+    fprintf(file, "{\"role\": \"%s\", \"moves_evaluated\": %lld, \"moves_applied\": %lld, \"distance_lookups\": %lld, \"allocations\": %lld, \"restarts\": %lld, \"seconds\": {",
+            role, stats->moves_evaluated, stats->moves_applied, stats->distance_lookups, stats->allocations, stats->restarts);
+    for (int p = 0; p < NUM_PHASES; p++) fprintf(file, "%s\"%s\": %.6f", p > 0 ? ", " : "", phase_names[p], stats->seconds[p]);
+    fprintf(file, "}}");
+}
+
+// Same layout as the TSP solver's file, with the cost as dist and the cells
+// as nodes. The solver runs on one thread, so the total and its only thread
+// are the same.
+void save_stats(int cost) {
+    enter_phase(solver_stats.phase);
+    double time = 0;
+    for (int p = 0; p < NUM_PHASES; p++) time += solver_stats.seconds[p];
+
+    char filepath[256];
+    snprintf(filepath, sizeof(filepath), "Sudoku_results/%s_stats.json", NAME);
+    FILE *file = fopen(filepath, "w");
+    if (!file) {
+        printf("Error creating file %s\n", filepath);
+        return;
+    }
+    fprintf(file, "{\"solver\": \"Sudoku\", \"name\": \"%s\", \"nodes\": %d, \"dist\": %d, \"seconds\": %.6f,\n\"total\": ", NAME, N * N, cost, time);
+    write_stats_entry(file, "total", &solver_stats);
+    fprintf(file, ",\n\"threads\": [\n  ");
+    write_stats_entry(file, "main", &solver_stats);
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    LOG(LOG_SUMMARY, "Stats saved in %s\n", filepath);
+}
+#endif
+
 void generate_greedy_tour(Cell specific_cell, int specific_number) {
     for (int i = 0; i < N; i++) {
         for (int j = 0; j < N; j++) {
@@ -219,7 +361,7 @@ void generate_greedy_tour(Cell specific_cell, int specific_number) {
             }
         }
     }
-    print_tour(tour);
+    if (LOG_LEVEL >= LOG_DEBUG) print_tour(tour);
 }
 
 void print_tour(int tour[N][N]) {
@@ -236,10 +378,15 @@ void print_tour(int tour[N][N]) {
 void two_opt(int tour[N][N], Cell *cells, int n, int *global_cost) {
     *global_cost = calculate_global_cost(tour);
     bool improved = true;
+    STATS_PHASE(PHASE_TWO_OPT);
 
     while (improved) {
         improved = false;
         for (int i = 0; i < n - 1; i++) {
+            if (out_of_time()) {
+                STATS_END_PHASE();
+                return;
+            }
             for (int j = i + 1; j < n; j++) {
                 Cell cell1 = cells[i];
                 Cell cell2 = cells[j];
@@ -249,9 +396,11 @@ void two_opt(int tour[N][N], Cell *cells, int n, int *global_cost) {
                     tour[cell1.row][cell1.col] = tour[cell2.row][cell2.col];
                     tour[cell2.row][cell2.col] = temp;
                     int new_cost = calculate_global_cost(tour);
+                    STATS_ADD(moves_evaluated, 1);
                     if (new_cost < *global_cost) {
                         *global_cost = new_cost;
                         improved = true;
+                        STATS_ADD(moves_applied, 1);
                     } else {
                         tour[cell2.row][cell2.col] = tour[cell1.row][cell1.col];
                         tour[cell1.row][cell1.col] = temp;
@@ -260,6 +409,7 @@ void two_opt(int tour[N][N], Cell *cells, int n, int *global_cost) {
             }
         }
     }
+    STATS_END_PHASE();
 }
 
 void two_opt_reverse(int tour[N][N], Cell *cells, int n) {
@@ -278,9 +428,11 @@ void two_opt_reverse(int tour[N][N], Cell *cells, int n) {
                     tour[cell1.row][cell1.col] = tour[cell2.row][cell2.col];
                     tour[cell2.row][cell2.col] = temp;
                     int new_cost = calculate_global_cost(tour);
+                    STATS_ADD(moves_evaluated, 1);
                     if (new_cost > global_cost) {
                         global_cost = new_cost;
                         improved = true;
+                        STATS_ADD(moves_applied, 1);
                     } else {
                         tour[cell2.row][cell2.col] = tour[cell1.row][cell1.col];
                         tour[cell1.row][cell1.col] = temp;
@@ -298,12 +450,14 @@ int two_opt_and_swap(int initial_tour[N][N], Cell *cells, int n) {
     int global_cost;
 
     memcpy(best_tour, initial_tour, sizeof(int) * N * N);
+    STATS_PHASE(PHASE_REVERSE);
     two_opt_reverse(best_tour, cells, n);
+    STATS_END_PHASE();
     two_opt(best_tour, cells, n, &global_cost);
     memcpy(current_tour, best_tour, sizeof(int) * N * N);
 
     if (global_cost == MIN_COST) {
-        printf("Found!\n");
+        LOG(LOG_SUMMARY, "Found!\n");
         memcpy(tour, best_tour, sizeof(int) * N * N);
         return global_cost;
     }
@@ -312,6 +466,7 @@ int two_opt_and_swap(int initial_tour[N][N], Cell *cells, int n) {
     while (improved) {
         improved = false;
         for (int i = 0; i < n - 1; i++) {
+            if (out_of_time()) break;
             for (int j = 0; j < n; j++) {
                 if (i != j) {
                     Cell cell1 = cells[i];
@@ -321,15 +476,17 @@ int two_opt_and_swap(int initial_tour[N][N], Cell *cells, int n) {
                         int temp = current_tour[cell1.row][cell1.col];
                         current_tour[cell1.row][cell1.col] = current_tour[cell2.row][cell2.col];
                         current_tour[cell2.row][cell2.col] = temp;
+                        STATS_ADD(moves_evaluated, 1);
+                        STATS_ADD(moves_applied, 1);
                         int new_cost;
                         two_opt(current_tour, cells, n, &new_cost);
                         if (new_cost < global_cost) {
                             memcpy(best_tour, current_tour, sizeof(int) * N * N);
                             global_cost = new_cost;
                             improved = true;
-                            printf("%d\n", global_cost);
+                            LOG(LOG_PROGRESS, "%d\n", global_cost);
                             if (global_cost == MIN_COST) {
-                                printf("Found!\n");
+                                LOG(LOG_SUMMARY, "Found!\n");
                                 memcpy(tour, best_tour, sizeof(int) * N * N);
                                 return global_cost;
                             }
@@ -341,13 +498,16 @@ int two_opt_and_swap(int initial_tour[N][N], Cell *cells, int n) {
             if (improved) break;
         }
     }
-    print_tour(best_tour);
+    if (LOG_LEVEL >= LOG_DEBUG) print_tour(best_tour);
     memcpy(tour, best_tour, sizeof(int) * N * N);
     return global_cost;
 }
 
+// Stops after MAX_RUNS runs, a solution or TIME_LIMIT seconds, whichever
+// comes first, and saves the lowest cost tour found.
 void solve_sudoku(int runs) {
-    clock_t start = clock();
+    double start = wall_time();
+    deadline = TIME_LIMIT > 0 ? start + TIME_LIMIT : 0;
     Cell cell_variations[MAX_RUNS];
     int number_variations[MAX_RUNS];
     int counter = 0;
@@ -376,28 +536,44 @@ void solve_sudoku(int runs) {
     }
 
     for (int run = 0; run < counter; run++) {
-        printf("Current run: %d\n", run + 1);
-        printf("%.2f seconds\n", (double)(clock() - start) / CLOCKS_PER_SEC);
-        printf("(%d,%d) %d\n", cell_variations[run].row, cell_variations[run].col, number_variations[run]);
+        LOG(LOG_PROGRESS, "Current run: %d, %.2f seconds, (%d,%d) %d\n", run + 1, wall_time() - start,
+            cell_variations[run].row, cell_variations[run].col, number_variations[run]);
+        STATS_ADD(restarts, 1);
+        STATS_PHASE(PHASE_CONSTRUCT);
         generate_greedy_tour(cell_variations[run], number_variations[run]);
+        STATS_SWITCH_PHASE(PHASE_PERTURB);
         int cost = two_opt_and_swap(tour, cells, n);
+        STATS_END_PHASE();
         if (cost < lowest_cost) {
             lowest_cost = cost;
+            memcpy(lowest_cost_tour, tour, sizeof(int) * N * N);
         }
         if (cost == MIN_COST) {
             break;
         }
+        if (out_of_time()) {
+            LOG(LOG_SUMMARY, "Time limit reached\n");
+            break;
+        }
     }
 
-    printf("Saving result...\n");
-    save_sudoku_file((double)(clock() - start) / CLOCKS_PER_SEC);
-    printf("Saved.\n");
-    printf("Total time: %.2f seconds\n", (double)(clock() - start) / CLOCKS_PER_SEC);
-    printf("Lowest cost: %d\n", lowest_cost);
+    LOG(LOG_SUMMARY, "Saving result...\n");
+    STATS_PHASE(PHASE_IO);
+    save_sudoku_file(wall_time() - start);
+    STATS_END_PHASE();
+    LOG(LOG_SUMMARY, "Saved.\n");
+    LOG(LOG_SUMMARY, "Total time: %.2f seconds\n", wall_time() - start);
+    LOG(LOG_SUMMARY, "Lowest cost: %d\n", lowest_cost);
+#if INSTRUMENT
+    save_stats(lowest_cost);
+#endif
 }
 
 int main() {
+    setvbuf(stdout, NULL, _IOFBF, LOG_BUFFER);
+    STATS_PHASE(PHASE_PARSE);
     parse_sudoku_file(FILEPATH);
+    STATS_SWITCH_PHASE(PHASE_PREPROCESS);
     for (int i = 0; i < N; i++) {
         numbers[i] = i + 1;
     }
@@ -406,6 +582,7 @@ int main() {
     if (!validate_sudoku()) {
         return 1;
     }
+    STATS_END_PHASE();
     solve_sudoku(MAX_RUNS);
     return 0;
 }
@@ -0,0 +1,90 @@
+import os
+import re
+import subprocess
+import tempfile
+import time
+
+#  Global variables
+SOLVER = "solver.c"
+INSTANCES_DIR = "TSP_instances"
+#  Bundled EUC_2D instances that come with an optimal tour.
+INSTANCES = ["pr76", "kroC100", "lin105", "xqf131", "ch130", "a280", "xqg237", "xit1083"]
+#  Each engine is a set of #define overrides applied to solver.c before compiling.
+#  Runs stop once they reach the optimal tour length, so seconds is the time to target when the gap is 0.
+ENGINES = {
+    "2-opt/Or-opt + swap": {"USE_LIN_KERNIGHAN": "0", "USE_ILS": "0"},
+    "Lin-Kernighan": {"USE_LIN_KERNIGHAN": "1", "USE_ILS": "0"},
+    "2-opt/Or-opt + ILS": {"USE_LIN_KERNIGHAN": "0", "USE_ILS": "1"},
+    "Lin-Kernighan + ILS": {"USE_LIN_KERNIGHAN": "1", "USE_ILS": "1"},
+}
+#  The 2-opt scan of the reverse phase, timed with each kernel on a single short run.
+SCAN_INSTANCES = ["a280", "xit1083", "pr2392"]
+SCANS = {
+    "scalar": {"USE_AVX2": "0"},
+    "AVX2": {"USE_AVX2": "1"},
+}
+SCAN_RUN = {"USE_LIN_KERNIGHAN": "0", "MAX_RUNS": "1", "NUM_THREADS": "1", "TIME_LIMIT": "1", "LOG_LEVEL": "3"}  # The phase time is a debug message.
+TIMEOUT = 3600  # Seconds allowed per run.
+
+
+def configure(source, overrides):
+    for name, value in overrides.items():
+        source, count = re.subn(rf"^#define {name} .*$", f"#define {name} {value}", source, flags=re.M)
+        if count != 1:
+            raise ValueError(f"#define {name} not found in {SOLVER}")
+    return source
+
+
+def optimal_tour_path(name):
+    for suffix in (".opt.tour", ".tour"):
+        path = os.path.join(INSTANCES_DIR, name + suffix)
+        if os.path.exists(path):
+            return path
+    return None
+
+
+def run_solver(source, name):
+    opt_path = optimal_tour_path(name)
+    source = configure(source, {
+        "FILEPATH": '"' + os.path.abspath(os.path.join(INSTANCES_DIR, name + ".tsp")) + '"',
+        "OPT_FILEPATH": '"' + os.path.abspath(opt_path) + '"' if opt_path else "NULL",
+        "NAME": '"' + name + '"',
+    })
+    with tempfile.TemporaryDirectory() as work_dir:
+        with open(os.path.join(work_dir, "solver.c"), 'w') as file:
+            file.write(source)
+        os.makedirs(os.path.join(work_dir, "TSP_results"), exist_ok=True)
+        subprocess.run(["gcc", "-O2", "-o", "solver", "solver.c", "-lm", "-pthread"], cwd=work_dir, check=True)
+
+        start = time.perf_counter()
+        output = subprocess.run(["./solver"], cwd=work_dir, capture_output=True, text=True, timeout=TIMEOUT).stdout
+        elapsed = time.perf_counter() - start
+    return output, elapsed
+
+
+def main():
+    with open(SOLVER, 'r') as file:
+        base_source = file.read()
+
+    print(f"{'instance':<10} {'engine':<22} {'length':>9} {'gap %':>7} {'seconds':>9}")
+    for name in INSTANCES:
+        for engine, overrides in ENGINES.items():
+            output, elapsed = run_solver(configure(base_source, overrides), name)
+            best = re.search(r"Best found distance: (\d+)", output)
+            optimal = re.search(r"Optimal distance: (\d+)", output)
+            best = int(best.group(1)) if best else None
+            optimal = int(optimal.group(1)) if optimal else None
+            gap = f"{100 * (best - optimal) / optimal:.2f}" if best and optimal else "-"
+            print(f"{name:<10} {engine:<22} {best if best else '-':>9} {gap:>7} {elapsed:>9.2f}")
+
+    print()
+    print(f"{'instance':<10} {'scan':<22} {'seconds':>9}")
+    for name in SCAN_INSTANCES:
+        for scan, overrides in SCANS.items():
+            output, _ = run_solver(configure(configure(base_source, SCAN_RUN), overrides), name)
+            phase = re.search(r"Reverse phase: ([\d.]+) seconds", output)
+            print(f"{name:<10} {scan:<22} {phase.group(1) if phase else '-':>9}")
+
+
+if __name__ == "__main__":
+    main()
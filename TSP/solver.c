@@ -3,19 +3,90 @@
 #include <string.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <time.h>
 #include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#else
+#define HAVE_AVX2 0
+#endif
 
-#define MAX_NODES 1000
 #define MAX_RUNS 5
+#define MAX_MATRIX_NODES 10000 // Above this, distances are computed from the coordinates instead of stored.
+#define KD_LEAF_SIZE 8
+#define GEO_PI 3.141592 // TSPLIB's value of pi for GEO coordinates, kept so lengths match published optima.
+#define GEO_RADIUS 6378.388 // Earth radius in km used by GEO distances.
+#define TWO_LEVEL_MIN_NODES 5000 // From this size on, tours are stored as a two-level list.
+#define NUM_CANDIDATES 10 // K nearest neighbors searched by 2-opt and Or-opt
+#define OR_OPT_MAX_SEGMENT 3 // Longest segment moved by Or-opt, 0 leaves only 2-opt.
+#define USE_LIN_KERNIGHAN 0 // 1 optimizes each run with lin_kernighan, 0 with two_opt_and_swap.
+#define LK_MAX_DEPTH 50 // Most 2-opt moves chained by one Lin-Kernighan step.
+#define USE_ILS 0 // 1 perturbs each run with random kicks (iterated local search), 0 with candidate swaps.
+#define ILS_KICK 0 // 0 kicks with a double bridge, 1 with a segment reversal.
+#define ILS_SEGMENT 50 // Longest segment moved or reversed by a kick.
+#define ILS_ACCEPT 1 // Kicked tours kept: 0 shorter, 1 shorter or equal, 2 shorter or equal and restart after ILS_STAGNATION kicks without improvement.
+#define ILS_STAGNATION 0 // Kicks without improvement before a restart, 0 uses n.
+#define ILS_KICKS 0 // Kicks per run, 0 uses 10 * n.
+#define USE_TOUR_MERGING 1 // 1 recombines each run's tour with the best one (partition crossover), 0 keeps only the best run.
+#define MERGE_FUSIONS 2 // Times a merge retries the components it could not swap, fused with their neighbors.
+#define PARTITION_CELL_NODES 0 // Planar instances with more nodes are split into cells of at most this many, solved separately and stitched together. 0 never splits.
+#define SEED 1 // Seeds the random kicks. Each run draws from its own stream, so results do not depend on thread timing.
+#define HILBERT_ORDER 1 // 1 renumbers nodes along a Hilbert curve so nearby nodes share cache lines, 0 keeps file order.
+#define HILBERT_BITS 16 // Coordinates are scaled to a 2^HILBERT_BITS grid before computing curve positions.
+#define USE_AVX2 1 // 1 runs the distance and 2-opt scan kernels with AVX2 when the CPU supports it, 0 always uses the scalar loops.
+#define USE_CACHE 1 // 1 saves the pre-processed instance to FILEPATH.cache and maps it on later runs, 0 always pre-processes.
+#define CACHE_MAGIC "TSPCACHE"
+#define CACHE_VERSION 1 // Bump whenever the layout or the meaning of cached data changes.
+#define CHECKPOINTS 1 // 1 also saves the best tour and the next run to TSP_results/NAME.checkpoint after every batch of runs.
+#define RESUME 0 // 1 continues from TSP_results/NAME.checkpoint when it was written for this instance file and SEED.
+#define CHECKPOINT_MAGIC "TSPCHKPT"
+#define CHECKPOINT_VERSION 2
+#define NUM_THREADS 0 // Runs executed concurrently, 0 uses one thread per core.
+#define TIME_LIMIT 0 // Wall-clock seconds for the whole solve, 0 runs without a limit.
+#define USE_LOWER_BOUND 1 // 1 computes a Held-Karp lower bound before the runs and reports the gap of each new best tour. Needs the distance matrix.
+#define BOUND_ITERATIONS 0 // Most subgradient steps of the lower bound, 0 uses 1000 (100000000 / n^2 in [100, 1000] when the candidate graph is not connected).
+#define TARGET_GAP 0 // Stop once the best tour is at most this many percent above the lower bound, 0 never stops on the gap.
+#define ALPHA_CANDIDATES 0 // 1 gives the optimizers the alpha-nearest candidates of the lower bound instead of the nearest ones.
+#define TARGET_DIST 0 // Stop once a tour this short is found. 0 uses the OPT_FILEPATH length if any, -1 never stops early.
+#define ABANDON_PERCENT 3 // After each perturbation round, a run stops if it is this much longer than the best run so far.
 #define FILEPATH "TSP_instances/xqf131.tsp"
 #define OPT_FILEPATH "TSP_instances/xqf131.tour" // Optional set to NULL if theres none.
 #define NAME "xqf131"
+#define START_FILEPATH NULL // Optional .tour file, an earlier result or any other tour, that the first run starts from instead of a nearest neighbor tour.
+#define LOG_LEVEL 1 // 0 prints errors and warnings only, 1 also a summary of the solve, 2 also runs and improvements at most once per LOG_INTERVAL, 3 every message and the nearest neighbor tours.
+#define LOG_INTERVAL 1.0 // Seconds between two progress lines at LOG_LEVEL 2.
+#define LOG_BUFFER 65536 // Bytes of output held before a write. Messages below LOG_LEVEL 3 flush it at once.
+#define INSTRUMENT 0 // 1 counts moves, distance lookups, allocations and restarts per thread and times each phase, saved to TSP_results/NAME_stats.json. 0 compiles it all out.
 
 typedef struct {
-    long long int x, y; // int may be small for some coordinates
+    double x, y; // GEO instances hold latitude and longitude in radians
 } Point;
 
+// Distance kernel of one EDGE_WEIGHT_TYPE, picked once by parse_tsp_file.
+typedef int (*DistanceFunction)(Point p1, Point p2);
+
+// A parsed TSPLIB instance. Coordinate instances keep their points and
+// distance kernel; EXPLICIT instances keep the weights instead.
+typedef struct {
+    Point* points; // NULL for EXPLICIT
+    int* weights; // EXPLICIT only: entry (a, b), a < b, at triangle_index(n, a, b)
+    DistanceFunction distance;
+    bool planar; // distances grow with the planar distance, so the k-d tree finds nearest nodes
+    double planar_scale; // planar length of one distance unit, bounds k-d tree searches
+    int max_distance; // no distance is longer, sizes the matrix entries
+    int n;
+} Instance;
+
 typedef struct {
     int* tour;
     int dist;
@@ -26,20 +97,502 @@ typedef struct {
     int distance;
 } Neighbor;
 
-Point* parse_tsp_file(const char* file_path, int* num_points);
+typedef struct {
+    uint64_t key; // position along the Hilbert curve
+    int node;
+} CurvePoint;
+
+typedef struct {
+    int* nodes; // k nearest neighbors of node i in nodes[i * k], closest first
+    int* distances; // distances[i * k + j] = distance from i to nodes[i * k + j]
+    int k;
+} CandidateList;
+
+// Small instances store the upper triangle of the symmetric matrix in one
+// cache-aligned block, with 16-bit entries when every distance fits. Large
+// instances keep only the points and compute each distance on the fly, so
+// memory is O(n) plus the candidate lists.
+typedef struct {
+    void* triangle; // entry (a, b), a < b, at triangle_index(n, a, b); NULL in implicit mode
+    bool narrow; // entries are uint16_t, otherwise int32_t
+    const Point* points;
+    DistanceFunction distance;
+    int n;
+} Distances;
+
+// Finds the first j in [from, n) such that reversing tour[i + 1..j] makes the
+// tour longer, or returns n.
+typedef int (*ScanFunction)(const Distances* distances, const int* tour, int n, int i, int from);
+
+// k-d tree over the points, split at the median of the widest coordinate.
+// Node i covers points perm[lo..hi); leaves have left == right == -1.
+typedef struct {
+    int lo, hi;
+    int left, right, parent;
+    int dim; // 0 splits on x, 1 on y
+    double split;
+} KdNode;
+
+typedef struct {
+    const Point* points;
+    DistanceFunction distance;
+    double reach_scale; // planar_scale of the instance
+    int* perm;
+    int* leaf_of; // leaf holding each point
+    KdNode* nodes;
+    int num_nodes;
+    int n;
+} KdTree;
+
+// Work shared by the threads of pre_process. Thread id handles the nodes
+// id, id + num_threads, ... so that the shrinking triangle rows even out.
+typedef struct {
+    const Instance* instance;
+    const KdTree* tree; // NULL when candidates are picked from whole rows
+    CandidateList* candidates;
+    Distances* distances;
+    const double* xs; // coordinates as structure of arrays for the row kernel
+    const double* ys;
+    bool avx2;
+    bool ceiling; // the AVX2 kernel rounds up (CEIL_2D) instead of to nearest (EUC_2D)
+    int num_threads;
+    int id;
+} PreProcessJob;
+
+// Everything solve_tsp derives from the instance before the first run. The
+// arrays are either built by pre_process or point into a mapped cache file.
+typedef struct {
+    Instance work; // instance with renumbered points, otherwise sharing the parsed arrays
+    int* original_id; // original_id[node] = node in file order, NULL when not renumbered
+    int* renumbered; // inverse of original_id
+    CandidateList candidates;
+    Distances distances;
+    void* mapping; // cache file backing points, original_id, candidates and matrix; NULL when built
+    size_t mapping_size;
+} Prepared;
+
+// Header of the cache file. Each array follows at a 64-byte aligned offset
+// (0 when absent) so a mapping can be used in place. A cache is only valid on
+// the machine that wrote it, for the same instance file and settings: loading
+// compares the whole header against the one the current run would write.
+typedef struct {
+    char magic[8]; // CACHE_MAGIC
+    uint32_t version; // CACHE_VERSION
+    uint32_t n;
+    int64_t source_size; // size and modification time of the instance file
+    int64_t source_mtime;
+    int32_t k; // candidates per node
+    int32_t hilbert_bits; // 0 when nodes keep file order
+    int32_t has_triangle;
+    int32_t narrow;
+    uint64_t points_offset;
+    uint64_t original_id_offset;
+    uint64_t nodes_offset;
+    uint64_t distances_offset;
+    uint64_t triangle_offset;
+    uint64_t size; // whole file
+} CacheHeader;
+
+// Header of the checkpoint file, followed by the best tour as n int32 node
+// IDs in file order. Runs before next_run are finished. Each run draws its
+// random numbers from SEED and its own index, so the seed and next_run are
+// all a resumed solve needs to carry on with the same runs.
+typedef struct {
+    char magic[8]; // CHECKPOINT_MAGIC
+    uint32_t version; // CHECKPOINT_VERSION
+    uint32_t n;
+    int64_t source_size; // size and modification time (ns) of the instance file
+    int64_t source_mtime;
+    uint64_t seed; // SEED
+    int32_t next_run;
+    int32_t dist;
+    double time; // seconds spent before the checkpoint
+} CheckpointHeader;
+
+// Saves improvements off the solver threads. collect_batch copies each new
+// best tour into pending and wakes the writer, which swaps it with its own
+// buffer and writes the tour file and checkpoint while the runs go on. A
+// newer tour handed over before the write starts replaces the older one.
+// Batches without an improvement only hand over next_run, and the writer
+// checkpoints the last tour it wrote.
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int* pending; // latest tour handed over, working numbering
+    int* writing; // tour being written
+    const int* original_id;
+    int num_nodes;
+    int tourfile_number;
+    int dist, next_run;
+    double time; // when the pending tour was found
+    double elapsed; // seconds spent when next_run was handed over
+    bool has_tour; // pending holds a tour the writer has not written
+    bool has_pending;
+    bool closing; // write what is pending, then exit
+} TourWriter;
+
+// Tour with O(1) next, prev and between. Small tours are a plain array with
+// a position index. From TWO_LEVEL_MIN_NODES on, the array is cut into about
+// sqrt(n) segments that can each be read backwards, so a reversal splits at
+// most two segments and flips the ones in between: O(sqrt(n)) per move.
+typedef struct {
+    int* order; // nodes, segment by segment
+    int* slot; // slot[node] = index of node in order
+    int* seg; // seg[node] = segment holding node
+    int* scratch;
+    int* seg_lo; // segment s covers order[seg_lo[s]..seg_hi[s])
+    int* seg_hi;
+    bool* seg_reversed; // segment s is walked from seg_hi[s] - 1 down to seg_lo[s]
+    int* seg_order; // segments in tour order
+    int* seg_rank; // seg_rank[s] = index of s in seg_order
+    int num_segments, max_segments, group_size;
+    int n;
+    bool two_level;
+} Tour;
+
+// When runs have to stop early. Checked between perturbation trials and every
+// few hundred local search steps, so a run returns its tour soon after.
+typedef struct {
+    double deadline; // wall_time() at which runs stop, 0 for no limit
+    int target_dist; // runs stop once any of them is this short, 0 for no target
+    atomic_int* incumbent; // best length published by any finished run
+} Budget;
+
+// Working tour shared by the local search and the perturbation loop.
+typedef struct {
+    Tour tour;
+    int* queue; // nodes with the don't-look bit off
+    bool* queued;
+    int head, queue_size;
+    int* log; // 2-opt moves (a, b, c, d) applied since the last commit, for undo
+    int log_size, log_capacity;
+    const Budget* budget; // NULL when the search runs to the end
+    int n;
+} TourState;
+
+// Buffers owned by one worker and reused by all of its runs, so that no run
+// allocates once the arena is set up. The optimizers return result as the
+// tour of their TourResult; collect_batch takes it over when it is the new
+// best tour and hands the previous best buffer back in its place.
+typedef struct {
+    TourState state; // working tour of the local search
+    int* initial_tour; // nearest neighbor tour
+    int* worsened_tour; // output of the reverse phase
+    bool* visited; // nearest neighbor scratch
+    int* remaining; // unvisited points per k-d tree node, NULL without a tree
+    int* result;
+} RunArena;
+
+typedef struct {
+    double key;
+    int node;
+} HeapEntry;
+
+// Minimum 1-tree under node penalties pi: a spanning tree of nodes 1..n-1,
+// grown by Prim from node 1, plus the two shortest edges of node 0. Edge
+// (a, b) costs d(a, b) + pi[a] + pi[b], which changes the length of every
+// tour by the same 2 * sum(pi) but not that of every 1-tree.
+typedef struct {
+    double* pi;
+    double* best_pi; // penalties of the best bound so far
+    double* key; // cost of the edge to parent, once a node is in the tree
+    int* parent; // -1 for node 1 and node 0
+    int* order; // nodes 1..n-1 in the order Prim added them, parents first
+    int* degree;
+    bool* in_tree;
+    int* row; // distance_row scratch
+    int* first_edge; // candidate graph in both directions: node i has edges first_edge[i]..first_edge[i + 1] - 1
+    int* edge_node;
+    int* edge_distance;
+    HeapEntry* heap; // Prim's queue on the candidate graph, one entry per improved key
+    int first, second; // the two neighbors of node 0
+    int n;
+} OneTree;
+
+// Scratch space of partition_crossover, allocated once per solve. Components
+// are named by a node, so per-component arrays are indexed by node.
+typedef struct {
+    int* pos_child; // position of each node in the child
+    int* pos_b; // position of each node in the second parent
+    int* component;
+    int* mate_b; // other end of the second parent's path through a component, -1 inside paths
+    int* length_a; // length of the edges of a parent inside each component
+    int* length_b;
+    int* first_portal; // portals of component c are portals[first_portal[c]..first_portal[c + 1])
+    int* portals; // nodes with an edge leaving their component
+    Neighbor* by_position; // portals of one component, sorted by position in the child
+    int* slot_node; // ends of the child's runs through one component: first node of run r at 2r, last at 2r + 1
+    int* slot_of; // slot of a portal
+    bool* fuse; // nodes of components a merge could not swap, joined to their neighbors on the next try
+    int* child;
+    int* next_child;
+    int n;
+} TourMerge;
+
+// Shared by the worker threads of solve_tsp. Runs are executed in batches of
+// num_threads; the abandon cutoff only changes between batches, so the result
+// depends on the thread count but not on thread timing.
+typedef struct {
+    const Distances* distances;
+    const CandidateList* candidates;
+    const KdTree* tree;
+    const int* original_id; // original_id[node] = node in file order, NULL when not renumbered
+    const int* renumbered; // inverse of original_id
+    int num_points;
+    int first_point;
+    int num_runs;
+    int num_threads;
+    int tourfile_number;
+    double start;
+    Budget budget;
+    bool stop; // set between batches once the budget is spent
+    pthread_barrier_t barrier;
+    atomic_int incumbent; // best length published by any finished run
+    int abandon_above;
+    TourResult* batch; // one result slot per thread, its tour is borrowed from the thread's arena
+    RunArena* arenas;
+    TourMerge merge; // used by collect_batch only
+    TourWriter writer;
+    int next_run; // first run of the next batch, counting the runs of a resumed solve
+    int saved_dist; // length of the last tour handed to the writer
+    const int* start_tour; // START_FILEPATH tour in working numbering, the first run starts from it; NULL when there is none
+    const CandidateList* search_candidates; // candidates of the optimizers, nearest_neighbor keeps the nearest ones
+    int lower_bound; // 0 when not computed
+    int* best_tour;
+    int shortest_dist;
+} MultiStart;
+
+typedef struct {
+    MultiStart* shared;
+    int id;
+} Worker;
+
+// Space partition of solve_tsp for large planar instances (Karp). Cells
+// are consecutive stretches of the Hilbert curve, so each one is compact and
+// borders the next; they are stitched together in that order. Every worker
+// solves whole cells as instances of their own, so its memory depends on the
+// cell size only. Nothing is built for the whole instance but the candidate
+// lists, which the cells fill in, and the k-d tree of the border work.
+typedef struct {
+    const Instance* instance; // working numbering
+    const int* order; // nodes along the Hilbert curve, NULL when the working numbering follows it
+    int* tour; // cell c writes its subtour to tour[cell_start(c)..cell_start(c + 1))
+    CandidateList candidates; // lists within the cell of each node, padded with -1 when the cell has fewer
+    Point* box_lo; // bounding box of cell c
+    Point* box_hi;
+    int num_cells;
+    int num_threads;
+    atomic_int next_cell; // next cell to be claimed by a worker
+    double deadline; // 0 for no limit, otherwise split evenly among the cells left
+} Partition;
+
+#define LOG_SUMMARY 1
+#define LOG_PROGRESS 2
+#define LOG_DEBUG 3
+
+// Prints a message of the given level. Levels above LOG_LEVEL are compiled
+// out with their arguments, so a quiet build formats nothing in the runs.
+// Errors and warnings keep using printf and are always shown.
+#define LOG(level, ...) do { \
+    if (LOG_LEVEL >= (level) && log_due(level)) { \
+        printf(__VA_ARGS__); \
+        if ((level) < LOG_DEBUG) fflush(stdout); \
+    } \
+} while (0)
+
+atomic_llong next_progress; // microseconds of wall_time() before which LOG_PROGRESS messages are dropped
+
+#if INSTRUMENT
+// Phases timed by INSTRUMENT. A thread is in exactly one at any time:
+// entering a phase pauses the one it was in, so the phase times of a thread
+// add up to its lifetime.
+typedef enum {
+    PHASE_OTHER, // waiting for other threads and everything not listed below
+    PHASE_PARSE,
+    PHASE_PREPROCESS, // renumbering, candidates, matrix, cache loading and lower bound
+    PHASE_CONSTRUCT, // nearest neighbor tours
+    PHASE_REVERSE,
+    PHASE_TWO_OPT, // local search, Lin-Kernighan included
+    PHASE_PERTURB, // swaps and kicks, without the local search repairing them
+    PHASE_MERGE,
+    PHASE_IO, // tour files, checkpoints and the cache file
+    NUM_PHASES
+} Phase;
+
+// Counters of one thread. Each thread updates its own copy in thread-local
+// storage, so counting needs no atomics; finished threads add theirs to the
+// list written by save_stats.
+typedef struct {
+    const char* role;
+    long long moves_evaluated; // scored 2-opt, Or-opt, Lin-Kernighan and swap moves, reverse phase included
+    long long moves_applied; // 2-opt moves, reversals and swaps made, later undone or not
+    long long distance_lookups;
+    long long allocations; // search buffers: arenas, tour states and undo log growth
+    long long restarts; // runs and cells started, ILS restarts
+    double seconds[NUM_PHASES];
+    Phase phase;
+    double phase_start; // 0 before the thread has entered a phase
+} Stats;
+
+_Thread_local Stats thread_stats;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+Stats* finished_stats; // one entry per finished thread
+int num_finished_stats;
+
+#define STATS_ADD(counter, amount) (thread_stats.counter += (amount))
+#define STATS_START_THREAD(name, phase) (thread_stats.role = (name), enter_phase(phase))
+#define STATS_FINISH_THREAD() finish_thread_stats()
+#define STATS_PHASE(phase) Phase stats_outer = enter_phase(phase)
+#define STATS_SWITCH_PHASE(phase) enter_phase(phase) // to the next phase of a STATS_PHASE block
+#define STATS_END_PHASE() enter_phase(stats_outer)
+#else
+#define STATS_ADD(counter, amount) ((void)0)
+#define STATS_START_THREAD(name, phase) ((void)0)
+#define STATS_FINISH_THREAD() ((void)0)
+#define STATS_PHASE(phase) ((void)0)
+#define STATS_SWITCH_PHASE(phase) ((void)0)
+#define STATS_END_PHASE() ((void)0)
+#endif
+
+bool scan_word(const char** cursor, const char* end, char* word, int size);
+bool scan_number(const char** cursor, const char* end, double* value);
+bool parse_weights(const char** cursor, const char* end, Instance* instance, const char* format);
+bool select_metric(Instance* instance, const char* type);
+bool parse_tsp_file(const char* file_path, Instance* instance);
+void free_instance(Instance* instance);
 int* parse_tour_file(const char* file_path, int* num_points);
+int* load_start_tour(const char* file_path, int n);
 int create_tour_file();
-void update_tour_file(const int* tour, int num_nodes, int dist, double time, int tourfile_number);
-int** pre_process(Point* points, int num_points);
-int calculate_distance(Point p1, Point p2);
-int calculate_tour_length(const int* tour, int n, int** distances);
-int calculate_tour_distance(Point* points, const int* tour, int n);
-TourResult two_opt_swap(int** distances, const int* initial_tour, int n);
-int* two_opt_reverse(int** distances, const int* initial_tour, int n);
-TourResult two_opt_and_swap(int** distances, const int* initial_tour, int n);
-int* nearest_neighbor(int** distances, int n, int initial_point);
-void free_distances(int** distances, int num_points);
+void update_tour_file(const int* tour, const int* original_id, int num_nodes, int dist, double time, int tourfile_number);
+bool checkpoint_header(int n, CheckpointHeader* header);
+void save_checkpoint(const int* tour, const int* original_id, int n, int dist, int next_run, double time);
+int* load_checkpoint(int n, CheckpointHeader* header);
+void start_writer(TourWriter* writer, const int* original_id, int num_nodes, int tourfile_number);
+void submit_tour(TourWriter* writer, const int* tour, int dist, int next_run, double time);
+void* writer_thread(void* arg);
+void stop_writer(TourWriter* writer);
+uint64_t hilbert_key(uint32_t x, uint32_t y);
+int* hilbert_order(const Point* points, int n);
+Distances pre_process(const Instance* instance, const KdTree* tree, CandidateList* candidates, int num_threads);
+void* pre_process_worker(void* arg);
+void renumber_instance(const Instance* instance, Prepared* prep);
+uint64_t cache_place(uint64_t* offset, size_t bytes);
+bool cache_layout(const char* source_path, const Instance* instance, CacheHeader* header);
+bool cache_write(FILE* file, uint64_t offset, const void* data, size_t bytes);
+void save_cache(const char* cache_path, const char* source_path, const Instance* instance, const Prepared* prep);
+bool load_cache(const char* cache_path, const char* source_path, const Instance* instance, Prepared* prep);
+void free_prepared(Prepared* prep);
+void insert_neighbor(Neighbor* best, int* count, int k, Neighbor candidate);
+void select_nearest(const Instance* instance, int from, int k, Neighbor* best);
+void fill_row_scalar(const Distances* distances, const Instance* instance, int i);
+#if HAVE_AVX2
+void fill_row_avx2(const Distances* distances, const double* xs, const double* ys, int i, bool ceiling);
+#endif
+int euc_2d_distance(Point p1, Point p2);
+int ceil_2d_distance(Point p1, Point p2);
+int att_distance(Point p1, Point p2);
+int geo_distance(Point p1, Point p2);
+int instance_distance(const Instance* instance, int a, int b);
+double wall_time();
+bool log_due(int level);
+#if INSTRUMENT
+Phase enter_phase(Phase phase);
+void finish_thread_stats();
+void write_stats_entry(FILE* file, const Stats* stats);
+void save_stats(int num_nodes, int dist, double time);
+#endif
+bool budget_spent(const Budget* budget, int dist);
+size_t triangle_index(int n, int a, int b);
+int get_distance(const Distances* distances, int a, int b);
+void distance_row(const Distances* distances, int a, int* row);
+void build_kd_tree(KdTree* tree, const Instance* instance);
+int build_kd_node(KdTree* tree, int lo, int hi, int parent);
+void kd_search(const KdTree* tree, int node, const int* remaining, const bool* visited, int from, int k, Neighbor* best, int* count);
+void kd_remove(const KdTree* tree, int* remaining, int point);
+void free_kd_tree(KdTree* tree);
+int calculate_tour_length(const int* tour, int n, const Distances* distances);
+int calculate_tour_distance(const Instance* instance, const int* tour, int n);
+void reverse_segment(int* tour, int* pos, int n, int i, int j);
+void tour_layout(Tour* t, const int* nodes);
+void tour_init(Tour* t, const int* nodes, int n);
+void tour_free(Tour* t);
+int segment_first(const Tour* t, int s);
+int segment_last(const Tour* t, int s);
+int tour_next(const Tour* t, int node);
+int tour_prev(const Tour* t, int node);
+long long tour_position(const Tour* t, int node);
+bool tour_between(const Tour* t, int a, int b, int c);
+void tour_split(Tour* t, int s, int m);
+bool reverse_in_segment(Tour* t, int from, int to);
+void tour_reverse_path(Tour* t, int from, int to);
+void tour_swap(Tour* t, int u, int v);
+void tour_to_array(const Tour* t, int* out);
+void init_tour_state(TourState* state, const int* tour, int n);
+void reset_tour_state(TourState* state, const int* tour);
+void free_tour_state(TourState* state);
+void init_run_arena(RunArena* arena, int n, const KdTree* tree);
+void free_run_arena(RunArena* arena);
+void push_node(TourState* state, int node);
+void apply_two_opt(TourState* state, int a, int b, int c, int d);
+void two_opt_move(TourState* state, int a, int b, int c, int d);
+void apply_or_opt(TourState* state, int p, int a, int e, int f, int c1, int c2, bool reversed);
+void undo_moves(TourState* state, int keep);
+int swap_delta(const Distances* distances, const Tour* tour, int u, int v);
+int or_opt_move(const Distances* distances, const CandidateList* candidates, TourState* state, int a);
+int or2opt_local(const Distances* distances, const CandidateList* candidates, TourState* state);
+TourResult two_opt_swap(const Distances* distances, const CandidateList* candidates, RunArena* arena, const int* initial_tour, int n);
+int longer_scan_scalar(const Distances* distances, const int* tour, int n, int i, int from);
+#if HAVE_AVX2
+__m256i gather_distances(const Distances* distances, __m256i x, __m256i y);
+int longer_scan_avx2(const Distances* distances, const int* tour, int n, int i, int from);
+#endif
+ScanFunction select_scan(int n);
+void two_opt_reverse(const Distances* distances, const int* initial_tour, int* tour, int n);
+TourResult two_opt_and_swap(const Distances* distances, const CandidateList* candidates, RunArena* arena, const int* initial_tour, int n, int abandon_above, const Budget* budget, bool warm);
+int perturbation_stride(int n);
+bool lk_tabu(const int* edges, int num_edges, int a, int b);
+int lk_step(const Distances* distances, const CandidateList* candidates, TourState* state, int t1);
+int lk_local(const Distances* distances, const CandidateList* candidates, TourState* state);
+TourResult lin_kernighan(const Distances* distances, const CandidateList* candidates, RunArena* arena, const int* initial_tour, int n, int abandon_above, const Budget* budget);
+uint64_t next_random(uint64_t* state);
+int random_below(uint64_t* state, int bound);
+int apply_kick(const Distances* distances, TourState* state, uint64_t* rng, int max_segment);
+TourResult iterated_local_search(const Distances* distances, const CandidateList* candidates, RunArena* arena, const int* initial_tour, int n, int abandon_above, const Budget* budget, uint64_t seed);
+int* nearest_neighbor(const KdTree* tree, const Distances* distances, const CandidateList* candidates, RunArena* arena, int n, int origin, int initial_point);
+void free_distances(Distances* distances);
+void free_candidates(CandidateList* candidates);
+int nearest_neighbor_length(const Distances* distances);
+void init_one_tree(OneTree* tree, const CandidateList* candidates, int n);
+void free_one_tree(OneTree* tree);
+void heap_push(HeapEntry* heap, int* size, HeapEntry entry);
+HeapEntry heap_pop(HeapEntry* heap, int* size);
+double one_tree(const Distances* distances, OneTree* tree);
+double sparse_one_tree(OneTree* tree);
+double ascend(const Distances* distances, OneTree* tree, bool sparse, int upper_bound, int max_steps, double lambda, int period);
+int held_karp_bound(const Distances* distances, OneTree* tree, int upper_bound);
+void alpha_candidates(const Distances* distances, const OneTree* tree, CandidateList* candidates);
+void init_tour_merge(TourMerge* merge, int n);
+void free_tour_merge(TourMerge* merge);
+int find_component(int* component, int node);
+bool tour_adjacent(const int* tour, const int* pos, int n, int u, int v);
+int run_start(const int* tour, int n, const int* component);
+void mark_paths(const int* tour, int n, const int* component, int* mate);
+int outside_slot(int slot, int num_slots);
+bool swap_component(TourMerge* merge, const int* tour_b, int c);
+int crossover_pass(const Distances* distances, TourMerge* merge, const int* tour_b, bool* failed);
+int partition_crossover(const Distances* distances, TourMerge* merge, const int* tour_a, const int* tour_b);
+void merge_into_best(MultiStart* ms, const int* tour);
+void collect_batch(MultiStart* ms);
+void* multi_start_worker(void* arg);
+int cell_start(const Partition* partition, int c);
+void solve_cell(const Instance* cell, const Budget* budget, uint64_t seed, int* tour, CandidateList* candidates);
+void* partition_worker(void* arg);
+void stitch_cells(const Distances* distances, const Partition* partition);
+bool near_other_cell(const Partition* partition, const int* cell_of, int node, int reach);
+TourResult partition_tsp(const Prepared* prep, int num_threads, const Budget* budget);
 int compare_neighbors(const void* a, const void* b);
+int compare_curve_points(const void* a, const void* b);
 
 int compare_neighbors(const void* a, const void* b) {
     Neighbor* na = (Neighbor*)a;
@@ -48,50 +601,277 @@ int compare_neighbors(const void* a, const void* b) {
     return na->node - nb->node;
 }
 
-Point* parse_tsp_file(const char* file_path, int* num_points) {
-    FILE* file = fopen(file_path, "r");
-    if (!file) {
-        printf("Error: Unable to open file %s\n", file_path);
-        return NULL;
+int compare_curve_points(const void* a, const void* b) {
+    CurvePoint* pa = (CurvePoint*)a;
+    CurvePoint* pb = (CurvePoint*)b;
+    if (pa->key != pb->key) return pa->key < pb->key ? -1 : 1;
+    return pa->node - pb->node;
+}
+
+// Reads the next keyword, stopping at white space or ':'. Returns false at
+// the end of the file.
+bool scan_word(const char** cursor, const char* end, char* word, int size) {
+    const char* c = *cursor;
+    while (c < end && (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n')) c++;
+    int length = 0;
+    while (c < end && *c != ' ' && *c != '\t' && *c != '\r' && *c != '\n' && *c != ':') {
+        if (length < size - 1) word[length++] = *c;
+        c++;
     }
+    word[length] = '\0';
+    *cursor = c;
+    return length > 0;
+}
 
-    Point* points = malloc(MAX_NODES * sizeof(Point));
-    if (!points) {
-        fclose(file);
-        return NULL;
+// Hand-rolled strtod for the sections. Mantissas below 2^53 scaled by an exact
+// power of ten are correctly rounded; anything longer goes through strtod.
+bool scan_number(const char** cursor, const char* end, double* value) {
+    static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char* c = *cursor;
+    while (c < end && (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n')) c++;
+    const char* start = c;
+    bool negative = c < end && *c == '-';
+    if (c < end && (*c == '-' || *c == '+')) c++;
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    bool any = false;
+    for (; c < end && *c >= '0' && *c <= '9'; c++) {
+        any = true;
+        if (mantissa < 100000000000000000ULL) mantissa = mantissa * 10 + (*c - '0');
+        else exponent++;
+    }
+    if (c < end && *c == '.') {
+        for (c++; c < end && *c >= '0' && *c <= '9'; c++) {
+            any = true;
+            if (mantissa < 100000000000000000ULL) {
+                mantissa = mantissa * 10 + (*c - '0');
+                exponent--;
+            }
+        }
+    }
+    if (!any) return false;
+    if (c < end && (*c == 'e' || *c == 'E')) {
+        const char* e = c + 1;
+        bool negative_exponent = e < end && *e == '-';
+        if (e < end && (*e == '-' || *e == '+')) e++;
+        int power = 0;
+        bool any_exponent = false;
+        for (; e < end && *e >= '0' && *e <= '9'; e++, any_exponent = true) {
+            if (power < 10000) power = power * 10 + (*e - '0');
+        }
+        if (any_exponent) {
+            exponent += negative_exponent ? -power : power;
+            c = e;
+        }
     }
+    *cursor = c;
 
-    char line[256];
-    bool node_section = false;
-    int count = 0;
+    if (mantissa < (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+        *value = exponent < 0 ? mantissa / powers[-exponent] : mantissa * powers[exponent];
+    } else {
+        char buffer[64];
+        int length = c - start < 63 ? (int)(c - start) : 63;
+        memcpy(buffer, start, length);
+        buffer[length] = '\0';
+        *value = fabs(strtod(buffer, NULL));
+    }
+    if (negative) *value = -*value;
+    return true;
+}
 
-    while (fgets(line, sizeof(line), file)) {
-        if (strstr(line, "NODE_COORD_SECTION")) {
-            node_section = true;
-            continue;
+// EDGE_WEIGHT_SECTION in any of the TSPLIB layouts. The matrix is symmetric,
+// so a column-wise triangle is read as the row-wise triangle on the other side.
+bool parse_weights(const char** cursor, const char* end, Instance* instance, const char* format) {
+    int n = instance->n;
+    bool full = strcmp(format, "FULL_MATRIX") == 0;
+    bool upper = strcmp(format, "UPPER_ROW") == 0 || strcmp(format, "LOWER_COL") == 0
+              || strcmp(format, "UPPER_DIAG_ROW") == 0 || strcmp(format, "LOWER_DIAG_COL") == 0;
+    bool lower = strcmp(format, "LOWER_ROW") == 0 || strcmp(format, "UPPER_COL") == 0
+              || strcmp(format, "LOWER_DIAG_ROW") == 0 || strcmp(format, "UPPER_DIAG_COL") == 0;
+    bool diagonal = strstr(format, "DIAG") != NULL;
+    if (!full && !upper && !lower) {
+        printf("Error: Unsupported EDGE_WEIGHT_FORMAT %s\n", format);
+        return false;
+    }
+
+    instance->weights = calloc((size_t)n * (n - 1) / 2 + 1, sizeof(int));
+    for (int i = 0; i < n; i++) {
+        int lo = full || lower ? 0 : (diagonal ? i : i + 1);
+        int hi = full || upper ? n : (diagonal ? i + 1 : i);
+        for (int j = lo; j < hi; j++) {
+            double weight;
+            if (!scan_number(cursor, end, &weight)) {
+                printf("Error: EDGE_WEIGHT_SECTION ends early\n");
+                return false;
+            }
+            if (i != j) instance->weights[triangle_index(n, i < j ? i : j, i < j ? j : i)] = (int)weight;
+        }
+    }
+    return true;
+}
+
+// Picks the distance kernel once, so no call has to test the metric.
+bool select_metric(Instance* instance, const char* type) {
+    int n = instance->n;
+    if (strcmp(type, "EXPLICIT") == 0) {
+        if (instance->weights) {
+            instance->max_distance = 0;
+            for (size_t i = 0; i < (size_t)n * (n - 1) / 2; i++) {
+                if (instance->weights[i] > instance->max_distance) instance->max_distance = instance->weights[i];
+            }
+            free(instance->points);
+            instance->points = NULL;
+            return true;
+        }
+        if (!instance->points) {
+            printf("Error: EXPLICIT instance without EDGE_WEIGHT_SECTION\n");
+            return false;
         }
-        if (strstr(line, "EOF") || line[0] == '\0') break;
-
-        if (node_section) {
-            int id;
-            float x, y;
-            if (sscanf(line, "%d %f %f", &id, &x, &y) == 3) {
-                if (count >= MAX_NODES) {
-                    printf("Error: Too many points\n");
-                    free(points);
-                    fclose(file);
-                    return NULL;
+        printf("Warning: EXPLICIT instance without EDGE_WEIGHT_SECTION, using EUC_2D on its coordinates\n");
+        type = "EUC_2D";
+    }
+    if (!instance->points) {
+        printf("Error: %s instance without NODE_COORD_SECTION\n", type);
+        return false;
+    }
+
+    if (strcmp(type, "GEO") == 0) {
+        // DDD.MM degrees and minutes to radians.
+        for (int i = 0; i < n; i++) {
+            double* coords[2] = {&instance->points[i].x, &instance->points[i].y};
+            for (int c = 0; c < 2; c++) {
+                int degrees = (int)*coords[c];
+                *coords[c] = GEO_PI * (degrees + 5.0 * (*coords[c] - degrees) / 3.0) / 180.0;
+            }
+        }
+        instance->distance = geo_distance;
+        instance->planar = false;
+        instance->max_distance = (int)(GEO_RADIUS * GEO_PI) + 1;
+        return true;
+    }
+
+    if (strcmp(type, "EUC_2D") == 0) {
+        instance->distance = euc_2d_distance;
+        instance->planar_scale = 1;
+    } else if (strcmp(type, "CEIL_2D") == 0) {
+        instance->distance = ceil_2d_distance;
+        instance->planar_scale = 1;
+    } else if (strcmp(type, "ATT") == 0) {
+        instance->distance = att_distance;
+        instance->planar_scale = sqrt(10.0);
+    } else {
+        printf("Error: Unsupported EDGE_WEIGHT_TYPE %s\n", type);
+        return false;
+    }
+    instance->planar = true;
+    // Planar metrics never decrease with distance: the bounding box diagonal is the longest.
+    Point lo = instance->points[0], hi = instance->points[0];
+    for (int i = 1; i < n; i++) {
+        lo.x = fmin(lo.x, instance->points[i].x);
+        lo.y = fmin(lo.y, instance->points[i].y);
+        hi.x = fmax(hi.x, instance->points[i].x);
+        hi.y = fmax(hi.y, instance->points[i].y);
+    }
+    instance->max_distance = instance->distance(lo, hi);
+    return true;
+}
+
+// Maps the file and scans it in place: header lines are "KEY : VALUE", the
+// sections after them hold only numbers. DIMENSION sets the size, there is no
+// node limit.
+bool parse_tsp_file(const char* file_path, Instance* instance) {
+    memset(instance, 0, sizeof(Instance));
+    int fd = open(file_path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0 || info.st_size == 0) {
+        printf("Error: Unable to open file %s\n", file_path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    const char* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("Error: Unable to map file %s\n", file_path);
+        return false;
+    }
+    const char* cursor = data;
+    const char* end = data + info.st_size;
+
+    char key[64], type[64] = "EUC_2D", format[64] = "FULL_MATRIX";
+    bool ok = true;
+    while (ok && scan_word(&cursor, end, key, sizeof(key)) && strcmp(key, "EOF") != 0) {
+        if (strcmp(key, "NODE_COORD_SECTION") == 0 || strcmp(key, "DISPLAY_DATA_SECTION") == 0) {
+            bool display = key[0] == 'D';
+            if (instance->n <= 0) {
+                printf("Error: %s before DIMENSION\n", key);
+                ok = false;
+                break;
+            }
+            // n lines with distinct IDs from 1 to n list every node exactly once.
+            Point* points = malloc(instance->n * sizeof(Point));
+            bool* seen = calloc(instance->n, sizeof(bool));
+            for (int i = 0; i < instance->n && ok; i++) {
+                double id;
+                Point point;
+                ok = scan_number(&cursor, end, &id) && scan_number(&cursor, end, &point.x) && scan_number(&cursor, end, &point.y);
+                if (!ok) {
+                    printf("Error: %s does not list nodes 1 to %d\n", key, instance->n);
+                } else if (id != floor(id) || id < 1 || id > instance->n) {
+                    printf("Error: %s has node ID %g, not an integer from 1 to %d\n", key, id, instance->n);
+                    ok = false;
+                } else if (seen[(int)id - 1]) {
+                    printf("Error: %s lists node %d twice\n", key, (int)id);
+                    ok = false;
+                } else {
+                    seen[(int)id - 1] = true;
+                    points[(int)id - 1] = point;
                 }
-                points[count].x = round(x);
-                points[count].y = round(y);
-                count++;
             }
+            free(seen);
+            // Display coordinates only stand in for missing node coordinates.
+            if (display && instance->points) free(points);
+            else {
+                free(instance->points);
+                instance->points = points;
+            }
+        } else if (strcmp(key, "EDGE_WEIGHT_SECTION") == 0) {
+            if (instance->n <= 0) {
+                printf("Error: %s before DIMENSION\n", key);
+                ok = false;
+                break;
+            }
+            ok = parse_weights(&cursor, end, instance, format);
+        } else {
+            // Header line: skip the separator and read the value up to the end of the line.
+            while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == ':')) cursor++;
+            const char* value = cursor;
+            while (cursor < end && *cursor != '\n' && *cursor != '\r') cursor++;
+            int length = (int)(cursor - value);
+            while (length > 0 && (value[length - 1] == ' ' || value[length - 1] == '\t')) length--;
+            char text[64];
+            snprintf(text, sizeof(text), "%.*s", length, value);
+            if (strcmp(key, "DIMENSION") == 0) instance->n = atoi(text);
+            else if (strcmp(key, "EDGE_WEIGHT_TYPE") == 0) strcpy(type, text);
+            else if (strcmp(key, "EDGE_WEIGHT_FORMAT") == 0) strcpy(format, text);
         }
     }
+    munmap((void*)data, info.st_size);
 
-    *num_points = count;
-    fclose(file);
-    return points;
+    if (ok) ok = select_metric(instance, type);
+    if (!ok) {
+        free_instance(instance);
+        return false;
+    }
+    return true;
+}
+
+void free_instance(Instance* instance) {
+    free(instance->points);
+    free(instance->weights);
+    instance->points = NULL;
+    instance->weights = NULL;
 }
 
 int* parse_tour_file(const char* file_path, int* num_points) {
@@ -100,7 +880,8 @@ int* parse_tour_file(const char* file_path, int* num_points) {
         return NULL;
     }
 
-    int* tour = malloc(MAX_NODES * sizeof(int));
+    int capacity = 1024;
+    int* tour = malloc(capacity * sizeof(int));
     if (!tour) {
         fclose(file);
         return NULL;
@@ -120,48 +901,84 @@ int* parse_tour_file(const char* file_path, int* num_points) {
         if (tour_section) {
             int point;
             if (sscanf(line, "%d", &point) == 1) {
-                if (count >= MAX_NODES) {
-                    printf("Error: Too many tour points\n");
-                    free(tour);
-                    fclose(file);
-                    return NULL;
+                if (count >= capacity) {
+                    capacity *= 2;
+                    int* grown = realloc(tour, capacity * sizeof(int));
+                    if (!grown) {
+                        printf("Error: Too many tour points\n");
+                        free(tour);
+                        fclose(file);
+                        return NULL;
+                    }
+                    tour = grown;
                 }
                 tour[count++] = point - 1; // 1-based to 0-based
             }
         }
     }
 
+    *num_points = count;
     fclose(file);
     return tour;
 }
 
+// Reads the tour to start from. Nodes out of range or repeated are dropped
+// and missing ones appended, with a warning, so the tour of a slightly
+// different instance still works. Returns NULL when there is none.
+int* load_start_tour(const char* file_path, int n) {
+    if (!file_path) return NULL;
+    int count;
+    int* tour = parse_tour_file(file_path, &count);
+    if (!tour) {
+        printf("Warning: Unable to read start tour %s, using nearest neighbor tours\n", file_path);
+        return NULL;
+    }
+    bool* seen = calloc(n, sizeof(bool));
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (tour[i] < 0 || tour[i] >= n || seen[tour[i]]) continue;
+        seen[tour[i]] = true;
+        tour[kept++] = tour[i];
+    }
+    int dropped = count - kept;
+    if (count < n) tour = realloc(tour, n * sizeof(int));
+    for (int node = 0; node < n; node++) {
+        if (!seen[node]) tour[kept++] = node;
+    }
+    if (dropped > 0 || kept > count - dropped) printf("Warning: Start tour %s does not match the instance, dropped %d nodes and appended %d\n", file_path, dropped, kept - (count - dropped));
+    free(seen);
+    LOG(LOG_SUMMARY, "Starting from %s\n", file_path);
+    return tour;
+}
+
+// Claims the first free TSP_results/NAME_<counter>.tour. O_EXCL makes the
+// claim atomic, so two solves started together never share a file.
 int create_tour_file() {
-    int counter = 1;
     char filepath[256];
-    snprintf(filepath, sizeof(filepath), "TSP_results/%s_%d.tour", NAME, counter); 
-
-    while (fopen(filepath, "r")) {
-        counter++;
+    for (int counter = 1;; counter++) {
         snprintf(filepath, sizeof(filepath), "TSP_results/%s_%d.tour", NAME, counter);
+        int fd = open(filepath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0) {
+            close(fd);
+            LOG(LOG_SUMMARY, "Tour file created in %s\n", filepath);
+            return counter;
+        }
+        if (errno != EEXIST) {
+            printf("Error: Unable to create file %s\n", filepath);
+            return 0;
+        }
     }
-
-    FILE* f = fopen(filepath, "w");
-    if (!f) {
-        printf("Error: Unable to create file %s\n", filepath);
-        return 0;
-    }
-
-    fclose(f);
-    printf("Tour file created in %s\n", filepath);
-
-    return counter;
 }
 
-void update_tour_file(const int* tour, int num_nodes, int dist, double time, int tourfile_number) {
-    char filepath[256];
+// Tours are written with file-order IDs; original_id maps them back when the
+// solver works on renumbered nodes. Written under a temporary name and
+// renamed, so a reader never sees half a tour.
+void update_tour_file(const int* tour, const int* original_id, int num_nodes, int dist, double time, int tourfile_number) {
+    char filepath[256], temp_path[300];
     snprintf(filepath, sizeof(filepath), "TSP_results/%s_%d.tour", NAME, tourfile_number);
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", filepath, (int)getpid());
 
-    FILE* f = fopen(filepath, "w");
+    FILE* f = fopen(temp_path, "w");
     if (!f) {
         printf("Error: Unable to update file %s\n", filepath);
         return;
@@ -172,280 +989,2800 @@ void update_tour_file(const int* tour, int num_nodes, int dist, double time, int
     fprintf(f, "TYPE: TOUR\n");
     fprintf(f, "DIMENSION: %d\n", num_nodes);
     fprintf(f, "TOUR_SECTION\n");
-    for (int i = 0; i < num_nodes; i++) fprintf(f, "%d\n", tour[i] + 1);
+    for (int i = 0; i < num_nodes; i++) fprintf(f, "%d\n", (original_id ? original_id[tour[i]] : tour[i]) + 1);
     fprintf(f, "-1\nEOF\n");
-    fclose(f);
-    printf("Tour updated in %s\n", filepath);
+    if (fclose(f) != 0 || rename(temp_path, filepath) != 0) {
+        remove(temp_path);
+        printf("Error: Unable to update file %s\n", filepath);
+        return;
+    }
+    LOG(LOG_PROGRESS, "Tour updated in %s\n", filepath);
 }
 
-int calculate_distance(Point p1, Point p2) {
-    return round(sqrt((p1.x - p2.x) * (p1.x - p2.x) + (p1.y - p2.y) * (p1.y - p2.y)));
+// Fills everything but next_run, dist and time.
+bool checkpoint_header(int n, CheckpointHeader* header) {
+    struct stat info;
+    memset(header, 0, sizeof(CheckpointHeader));
+    if (stat(FILEPATH, &info) < 0) return false;
+    memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+    header->version = CHECKPOINT_VERSION;
+    header->n = n;
+    header->source_size = info.st_size;
+    header->source_mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    header->seed = SEED;
+    return true;
 }
 
-int** pre_process(Point* points, int num_points) {
-    int** distances = malloc(num_points * sizeof(int*));
-    Neighbor* temp = malloc(num_points * sizeof(Neighbor));
-    for (int i = 0; i < num_points; i++) {
-        distances[i] = malloc(num_points * sizeof(int));
+void save_checkpoint(const int* tour, const int* original_id, int n, int dist, int next_run, double time) {
+    char path[256], temp_path[300];
+    snprintf(path, sizeof(path), "TSP_results/%s.checkpoint", NAME);
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int)getpid());
+    CheckpointHeader header;
+    FILE* file = checkpoint_header(n, &header) ? fopen(temp_path, "wb") : NULL;
+    if (!file) {
+        printf("Warning: Unable to write checkpoint %s\n", path);
+        return;
     }
-
-    for (int i = 0; i < num_points; i++) {
-        int temp_count = 0;
-        for (int j = 0; j < num_points; j++) {
-            if (i == j) {
-                distances[i][j] = 0;
-                continue;
-            }
-            temp[temp_count].node = j;
-            temp[temp_count].distance = calculate_distance(points[i], points[j]);
-            temp_count++;
-        }
-        qsort(temp, temp_count, sizeof(Neighbor), compare_neighbors);
-        for (int k = 0; k < temp_count; k++) {
-            distances[i][temp[k].node] = temp[k].distance;
-        }
+    header.next_run = next_run;
+    header.dist = dist;
+    header.time = time;
+    bool ok = fwrite(&header, sizeof(CheckpointHeader), 1, file) == 1;
+    for (int i = 0; i < n && ok; i++) {
+        int32_t node = original_id ? original_id[tour[i]] : tour[i];
+        ok = fwrite(&node, sizeof(int32_t), 1, file) == 1;
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp_path, path) != 0) {
+        remove(temp_path);
+        printf("Warning: Unable to write checkpoint %s\n", path);
     }
-    free(temp);
-    return distances;
 }
 
-int calculate_tour_length(const int* tour, int n, int** distances) {
-    int length = 0;
-    for (int i = 0; i < n; i++) {
-        int current = tour[i];
-        int next = tour[(i + 1) % n];
-        length += distances[current][next];
+// Returns the checkpointed tour in file order and fills header, or NULL when
+// there is no checkpoint for this instance file and SEED.
+int* load_checkpoint(int n, CheckpointHeader* header) {
+    char path[256];
+    snprintf(path, sizeof(path), "TSP_results/%s.checkpoint", NAME);
+    CheckpointHeader expected;
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    if (!checkpoint_header(n, &expected) || fread(header, sizeof(CheckpointHeader), 1, file) != 1
+        || memcmp(header, &expected, offsetof(CheckpointHeader, next_run)) != 0) {
+        fclose(file);
+        printf("Warning: Checkpoint %s is for another instance or SEED, starting over\n", path);
+        return NULL;
     }
-    return length;
+    int* tour = malloc(n * sizeof(int));
+    bool* seen = calloc(n, sizeof(bool));
+    bool ok = fread(tour, sizeof(int32_t), n, file) == (size_t)n;
+    for (int i = 0; i < n && ok; i++) {
+        ok = tour[i] >= 0 && tour[i] < n && !seen[tour[i]];
+        if (ok) seen[tour[i]] = true;
+    }
+    free(seen);
+    fclose(file);
+    if (!ok) {
+        free(tour);
+        printf("Warning: Checkpoint %s is damaged, starting over\n", path);
+        return NULL;
+    }
+    return tour;
 }
 
-int calculate_tour_distance(Point* points, const int* tour, int n) {
-    int total = 0;
-    for (int i = 0; i < n - 1; i++) {
-        total += calculate_distance(points[tour[i]], points[tour[i + 1]]);
-    }
-    total += calculate_distance(points[tour[n - 1]], points[tour[0]]);
-    return total;
+void start_writer(TourWriter* writer, const int* original_id, int num_nodes, int tourfile_number) {
+    writer->pending = malloc(num_nodes * sizeof(int));
+    writer->writing = malloc(num_nodes * sizeof(int));
+    writer->original_id = original_id;
+    writer->num_nodes = num_nodes;
+    writer->tourfile_number = tourfile_number;
+    writer->has_tour = false;
+    writer->has_pending = false;
+    writer->closing = false;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->wake, NULL);
+    pthread_create(&writer->thread, NULL, writer_thread, writer);
 }
 
-TourResult two_opt_swap(int** distances, const int* initial_tour, int n) {
-    int* best_tour = malloc(n * sizeof(int));
-    memcpy(best_tour, initial_tour, n * sizeof(int));
-    int shortest_dist = calculate_tour_length(best_tour, n, distances);
-    bool improved = true;
+// O(n) copy under the lock; the caller never waits for the disk. A NULL tour
+// only moves the checkpoint on to next_run.
+void submit_tour(TourWriter* writer, const int* tour, int dist, int next_run, double time) {
+    pthread_mutex_lock(&writer->lock);
+    if (tour) {
+        memcpy(writer->pending, tour, writer->num_nodes * sizeof(int));
+        writer->dist = dist;
+        writer->time = time;
+        writer->has_tour = true;
+    }
+    writer->next_run = next_run;
+    writer->elapsed = time;
+    writer->has_pending = true;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+}
 
-    while (improved) {
-        improved = false;
-        for (int i = 0; i < n - 1; i++) {
-            for (int j = i + 2; j < n; j++) {
-                int a = best_tour[i], b = best_tour[(i + 1) % n];
-                int c = best_tour[j], d = best_tour[(j + 1) % n];
-                int current_dist = distances[a][b] + distances[c][d];
-                int new_dist = distances[a][c] + distances[b][d];
-                if (new_dist < current_dist) {
-                    int delta = new_dist - current_dist;
-                    if (delta < 0) {
-                        for (int k = 0; k < (j - i) / 2; k++) {
-                            int temp = best_tour[i + 1 + k];
-                            best_tour[i + 1 + k] = best_tour[j - k];
-                            best_tour[j - k] = temp;
-                        }
-                        shortest_dist += delta;
-                        improved = true;
-                    }
-                }
-            }
+void* writer_thread(void* arg) {
+    TourWriter* writer = arg;
+    STATS_START_THREAD("writer", PHASE_OTHER);
+    pthread_mutex_lock(&writer->lock);
+    while (true) {
+        while (!writer->has_pending && !writer->closing) pthread_cond_wait(&writer->wake, &writer->lock);
+        if (!writer->has_pending) break;
+        bool new_tour = writer->has_tour;
+        if (new_tour) {
+            int* temp = writer->pending;
+            writer->pending = writer->writing;
+            writer->writing = temp;
         }
+        writer->has_tour = false;
+        writer->has_pending = false;
+        int* tour = writer->writing;
+        int dist = writer->dist, next_run = writer->next_run;
+        double time = writer->time, elapsed = writer->elapsed;
+        pthread_mutex_unlock(&writer->lock);
+
+        STATS_PHASE(PHASE_IO);
+        if (new_tour) update_tour_file(tour, writer->original_id, writer->num_nodes, dist, time, writer->tourfile_number);
+        if (CHECKPOINTS) save_checkpoint(tour, writer->original_id, writer->num_nodes, dist, next_run, elapsed);
+        STATS_END_PHASE();
+        pthread_mutex_lock(&writer->lock);
     }
+    pthread_mutex_unlock(&writer->lock);
+    STATS_FINISH_THREAD();
+    return NULL;
+}
 
-    TourResult result = {best_tour, shortest_dist};
-    return result;
+// Waits for the last tour handed over to be written.
+void stop_writer(TourWriter* writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = true;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->wake);
+    free(writer->pending);
+    free(writer->writing);
 }
 
-int* two_opt_reverse(int** distances, const int* initial_tour, int n) {
-    int* best_tour = malloc(n * sizeof(int));
-    memcpy(best_tour, initial_tour, n * sizeof(int));
-    int longest_dist = calculate_tour_length(best_tour, n, distances);
-    bool improved = true;
+// The four coordinate metrics of TSPLIB, rounded the way TSPLIB rounds them.
+int euc_2d_distance(Point p1, Point p2) {
+    double dx = p1.x - p2.x, dy = p1.y - p2.y;
+    return (int)(sqrt(dx * dx + dy * dy) + 0.5);
+}
 
-    while (improved) {
-        improved = false;
-        for (int i = 0; i < n - 1; i++) {
-            for (int j = i + 2; j < n; j++) {
-                int* temp_tour = malloc(n * sizeof(int));
-                memcpy(temp_tour, best_tour, n * sizeof(int));
-                for (int k = 0; k < (j - i) / 2; k++) {
-                    int temp = temp_tour[i + 1 + k];
-                    temp_tour[i + 1 + k] = temp_tour[j - k];
-                    temp_tour[j - k] = temp;
-                }
-                int new_dist = calculate_tour_length(temp_tour, n, distances);
-                if (new_dist > longest_dist) {
-                    free(best_tour);
-                    best_tour = temp_tour;
-                    longest_dist = new_dist;
-                    improved = true;
-                } else {
-                    free(temp_tour);
-                }
-            }
-        }
-    }
-    return best_tour;
+int ceil_2d_distance(Point p1, Point p2) {
+    double dx = p1.x - p2.x, dy = p1.y - p2.y;
+    return (int)ceil(sqrt(dx * dx + dy * dy));
 }
 
-TourResult two_opt_and_swap(int** distances, const int* initial_tour, int n) {
-    int* worsened_tour = two_opt_reverse(distances, initial_tour, n);
-    TourResult best = two_opt_swap(distances, worsened_tour, n);
-    free(worsened_tour);
-    int* best_tour = best.tour;
-    int shortest_dist = best.dist;
-    int* current_tour = malloc(n * sizeof(int));
-    memcpy(current_tour, best_tour, n * sizeof(int));
-    bool improved = true;
+// Pseudo-Euclidean distance of the att instances.
+int att_distance(Point p1, Point p2) {
+    double dx = p1.x - p2.x, dy = p1.y - p2.y;
+    double r = sqrt((dx * dx + dy * dy) / 10.0);
+    int t = (int)(r + 0.5);
+    return t < r ? t + 1 : t;
+}
 
-    while (improved) {
-        improved = false;
-        for (int i = 0; i < n - 1; i++) {
-            for (int j = 0; j < n; j++) {
-                if (i != j) {
-                    int temp = current_tour[i];
-                    current_tour[i] = current_tour[j];
-                    current_tour[j] = temp;
-                    TourResult temp_result = two_opt_swap(distances, current_tour, n);
-                    if (temp_result.dist < shortest_dist) {
-                        free(best_tour);
-                        best_tour = temp_result.tour;
-                        memcpy(current_tour, best_tour, n * sizeof(int));
-                        shortest_dist = temp_result.dist;
-                        improved = true;
-                        printf("2-opt improvement: %d\n", shortest_dist);
-                        break;
-                    } else {
-                        free(temp_result.tour);
-                    }
-                }
-            }
-            if (improved) break;
-        }
-    }
-end:
-    free(current_tour);
-    TourResult result = {best_tour, shortest_dist};
-    return result;
+// Great-circle distance in km between latitude/longitude points in radians.
+int geo_distance(Point p1, Point p2) {
+    double q1 = cos(p1.y - p2.y), q2 = cos(p1.x - p2.x), q3 = cos(p1.x + p2.x);
+    return (int)(GEO_RADIUS * acos(0.5 * ((1.0 + q1) * q2 - (1.0 - q1) * q3)) + 1.0);
 }
 
-int* nearest_neighbor(int** distances, int n, int initial_point) {
-    int* tour = malloc(n * sizeof(int));
-    bool* visited = calloc(n, sizeof(bool));
-    int tour_size = 0;
+int instance_distance(const Instance* instance, int a, int b) {
+    if (instance->points) return instance->distance(instance->points[a], instance->points[b]);
+    if (a == b) return 0;
+    return instance->weights[triangle_index(instance->n, a < b ? a : b, a < b ? b : a)];
+}
 
-    tour[tour_size++] = 0;
-    visited[0] = true;
-    if (initial_point != 0 && initial_point >= 0 && initial_point < n) {
-        tour[tour_size++] = initial_point;
-        visited[initial_point] = true;
+// Seconds on a monotonic wall clock. clock() adds up the CPU time of every
+// thread, so it runs ahead of real time once runs are solved in parallel.
+double wall_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// At LOG_LEVEL 2, lets one progress message through per LOG_INTERVAL across
+// all threads and drops the others.
+bool log_due(int level) {
+    if (level != LOG_PROGRESS || LOG_LEVEL > LOG_PROGRESS) return true;
+    long long now = (long long)(wall_time() * 1e6);
+    long long next = atomic_load(&next_progress);
+    return now >= next && atomic_compare_exchange_strong(&next_progress, &next, now + (long long)(LOG_INTERVAL * 1e6));
+}
+
+#if INSTRUMENT
+// Charges the time since the last switch to the current phase and moves to
+// phase. Returns the phase left, for STATS_END_PHASE.
+Phase enter_phase(Phase phase) {
+    double now = wall_time();
+    Phase previous = thread_stats.phase;
+    if (thread_stats.phase_start > 0) thread_stats.seconds[previous] += now - thread_stats.phase_start;
+    thread_stats.phase = phase;
+    thread_stats.phase_start = now;
+    return previous;
+}
+
+void finish_thread_stats() {
+    enter_phase(thread_stats.phase);
+    pthread_mutex_lock(&stats_lock);
+    finished_stats = realloc(finished_stats, (num_finished_stats + 1) * sizeof(Stats));
+    finished_stats[num_finished_stats++] = thread_stats;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void write_stats_entry(FILE* file, const Stats* stats) {
+    static const char* phase_names[NUM_PHASES] = {"other", "parse", "preprocess", "construct", "reverse", "two_opt", "perturbation", "merge", "io"};
+    fprintf(file, "{\"role\": \"%s\", \"moves_evaluated\": %lld, \"moves_applied\": %lld, \"distance_lookups\": %lld, \"allocations\": %lld, \"restarts\": %lld, \"seconds\": {",
+            stats->role ? stats->role : "", stats->moves_evaluated, stats->moves_applied, stats->distance_lookups, stats->allocations, stats->restarts);
+    for (int p = 0; p < NUM_PHASES; p++) fprintf(file, "%s\"%s\": %.6f", p > 0 ? ", " : "", phase_names[p], stats->seconds[p]);
+    fprintf(file, "}}");
+}
+
+// Called once by the main thread after every other thread has finished.
+// Writes the sum over all threads, then each thread on its own.
+void save_stats(int num_nodes, int dist, double time) {
+    finish_thread_stats();
+    Stats total = {.role = "total"};
+    for (int t = 0; t < num_finished_stats; t++) {
+        const Stats* stats = &finished_stats[t];
+        total.moves_evaluated += stats->moves_evaluated;
+        total.moves_applied += stats->moves_applied;
+        total.distance_lookups += stats->distance_lookups;
+        total.allocations += stats->allocations;
+        total.restarts += stats->restarts;
+        for (int p = 0; p < NUM_PHASES; p++) total.seconds[p] += stats->seconds[p];
     }
-    int last_element = initial_point != 0 ? initial_point : 0;
 
-    while (tour_size < n) {
-        int min_dist = INT_MAX;
-        int next_node = -1;
-        for (int j = 0; j < n; j++) {
-            if (!visited[j] && distances[last_element][j] < min_dist) {
-                min_dist = distances[last_element][j];
-                next_node = j;
-            }
-        }
-        if (next_node != -1) {
-            tour[tour_size++] = next_node;
-            visited[next_node] = true;
-            last_element = next_node;
+    char filepath[256];
+    snprintf(filepath, sizeof(filepath), "TSP_results/%s_stats.json", NAME);
+    FILE* file = fopen(filepath, "w");
+    if (!file) {
+        printf("Error: Unable to create file %s\n", filepath);
+    } else {
+        fprintf(file, "{\"solver\": \"TSP\", \"name\": \"%s\", \"nodes\": %d, \"dist\": %d, \"seconds\": %.6f,\n\"total\": ", NAME, num_nodes, dist, time);
+        write_stats_entry(file, &total);
+        fprintf(file, ",\n\"threads\": [");
+        for (int t = 0; t < num_finished_stats; t++) {
+            fprintf(file, "%s\n  ", t > 0 ? "," : "");
+            write_stats_entry(file, &finished_stats[t]);
         }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        LOG(LOG_SUMMARY, "Stats saved in %s\n", filepath);
     }
+    free(finished_stats);
+    finished_stats = NULL;
+    num_finished_stats = 0;
+}
+#endif
 
-    printf("[");
-    for (int i = 0; i < n; i++) {
-        printf("%d", tour[i]);
-        if (i < n - 1) printf(", ");
-    }
-    printf("]\n");
+// True when a run with the given length, or any finished run, should stop.
+bool budget_spent(const Budget* budget, int dist) {
+    if (!budget) return false;
+    if (budget->deadline > 0 && wall_time() >= budget->deadline) return true;
+    if (budget->target_dist <= 0) return false;
+    return dist <= budget->target_dist || atomic_load(budget->incumbent) <= budget->target_dist;
+}
 
-    free(visited);
-    return tour;
+// Position of (a, b), a < b, in a row-major upper triangle without diagonal.
+size_t triangle_index(int n, int a, int b) {
+    return (size_t)a * (2 * (size_t)n - a - 1) / 2 + (b - a - 1);
+}
+
+int get_distance(const Distances* distances, int a, int b) {
+    STATS_ADD(distance_lookups, 1);
+    if (!distances->triangle) return distances->distance(distances->points[a], distances->points[b]);
+    if (a == b) return 0;
+    if (a > b) {
+        int temp = a;
+        a = b;
+        b = temp;
+    }
+    size_t i = triangle_index(distances->n, a, b);
+    return distances->narrow ? ((const uint16_t*)distances->triangle)[i] : ((const int32_t*)distances->triangle)[i];
 }
 
-void free_distances(int** distances, int num_points) {
-    for (int i = 0; i < num_points; i++) free(distances[i]);
-    free(distances);
+// Distances from a to every node. Column a of the triangle is walked with a
+// running index instead of one triangle_index per entry, then row a is read
+// in order.
+void distance_row(const Distances* distances, int a, int* row) {
+    int n = distances->n;
+    STATS_ADD(distance_lookups, n);
+    if (!distances->triangle) {
+        for (int b = 0; b < n; b++) row[b] = get_distance(distances, a, b);
+        return;
+    }
+    const uint16_t* narrow = distances->triangle;
+    const int32_t* wide = distances->triangle;
+    size_t i = a - 1; // triangle_index(n, 0, a)
+    for (int b = 0; b < a; i += n - b - 2, b++) row[b] = distances->narrow ? narrow[i] : wide[i];
+    row[a] = 0;
+    i = a + 1 < n ? triangle_index(n, a, a + 1) : 0;
+    for (int b = a + 1; b < n; i++, b++) row[b] = distances->narrow ? narrow[i] : wide[i];
 }
 
-TourResult solve_tsp(Point* points, int num_points) { 
-    clock_t start = clock();
-    int** distances = pre_process(points, num_points);
-    int initial_point = 1;
-    int limit = initial_point + MAX_RUNS;
+double point_coord(Point p, int dim) {
+    return dim == 0 ? p.x : p.y;
+}
 
-    int* best_tour = NULL;
-    int shortest_dist = INT_MAX;
+// Only for planar instances, where the k nearest points in the plane are the
+// k nearest under the metric.
+void build_kd_tree(KdTree* tree, const Instance* instance) {
+    int n = instance->n;
+    tree->points = instance->points;
+    tree->distance = instance->distance;
+    tree->reach_scale = instance->planar_scale;
+    tree->n = n;
+    tree->perm = malloc(n * sizeof(int));
+    tree->leaf_of = malloc(n * sizeof(int));
+    tree->nodes = malloc((2 * (n / (KD_LEAF_SIZE / 2) + 1)) * sizeof(KdNode));
+    tree->num_nodes = 0;
+    for (int i = 0; i < n; i++) tree->perm[i] = i;
+    build_kd_node(tree, 0, n, -1);
+}
 
-    int tourfile_number = create_tour_file();
+int build_kd_node(KdTree* tree, int lo, int hi, int parent) {
+    int id = tree->num_nodes++;
+    KdNode* node = &tree->nodes[id];
+    node->lo = lo;
+    node->hi = hi;
+    node->parent = parent;
+    node->left = node->right = -1;
 
-    while (initial_point < limit) {
-        printf("current run: [%d], time: %.2f seconds\n", initial_point, (double)(clock() - start) / CLOCKS_PER_SEC);
+    if (hi - lo <= KD_LEAF_SIZE) {
+        for (int p = lo; p < hi; p++) tree->leaf_of[tree->perm[p]] = id;
+        return id;
+    }
 
-        int* initial_tour = nearest_neighbor(distances, num_points, initial_point);
-        TourResult result = two_opt_and_swap(distances, initial_tour, num_points);
+    double min_x = INFINITY, max_x = -INFINITY, min_y = INFINITY, max_y = -INFINITY;
+    for (int p = lo; p < hi; p++) {
+        Point pt = tree->points[tree->perm[p]];
+        if (pt.x < min_x) min_x = pt.x;
+        if (pt.x > max_x) max_x = pt.x;
+        if (pt.y < min_y) min_y = pt.y;
+        if (pt.y > max_y) max_y = pt.y;
+    }
+    int dim = max_x - min_x >= max_y - min_y ? 0 : 1;
 
-        free(initial_tour);
-        if (result.dist < shortest_dist) {
-            if (best_tour) free(best_tour);
-            best_tour = result.tour;
-            shortest_dist = result.dist;
-            printf("New shortest dist: %d\n", shortest_dist);
-            printf("Saving tour...\n");
-            update_tour_file(best_tour, num_points, shortest_dist, (double)(clock() - start) / CLOCKS_PER_SEC, tourfile_number);
-            printf("Saved\n");
-        } else {
-            free(result.tour);
-            update_tour_file(best_tour, num_points, shortest_dist, (double)(clock() - start) / CLOCKS_PER_SEC, tourfile_number);
+    // Quickselect so perm[lo..mid) <= perm[mid] <= perm[mid + 1..hi) on dim.
+    int* perm = tree->perm;
+    int mid = lo + (hi - lo) / 2;
+    int left = lo, right = hi - 1;
+    while (left < right) {
+        double pivot = point_coord(tree->points[perm[(left + right) / 2]], dim);
+        int i = left, j = right;
+        while (i <= j) {
+            while (point_coord(tree->points[perm[i]], dim) < pivot) i++;
+            while (point_coord(tree->points[perm[j]], dim) > pivot) j--;
+            if (i <= j) {
+                int temp = perm[i];
+                perm[i] = perm[j];
+                perm[j] = temp;
+                i++;
+                j--;
+            }
         }
-
-        initial_point++;
+        if (mid <= j) right = j;
+        else if (mid >= i) left = i;
+        else break;
     }
 
+    double split = point_coord(tree->points[perm[mid]], dim);
+    int left_child = build_kd_node(tree, lo, mid, id);
+    int right_child = build_kd_node(tree, mid, hi, id);
+    node = &tree->nodes[id];
+    node->dim = dim;
+    node->split = split;
+    node->left = left_child;
+    node->right = right_child;
+    return id;
+}
 
-    printf("Total time: %.2f seconds\n", (double)(clock() - start) / CLOCKS_PER_SEC);
+// Collects the k nearest points to `from` into best (sorted with compare_neighbors),
+// skipping `from` itself and visited points. remaining[node] counts the unvisited
+// points under each node so empty subtrees are skipped; both may be NULL.
+void kd_search(const KdTree* tree, int node, const int* remaining, const bool* visited, int from, int k, Neighbor* best, int* count) {
+    if (remaining && remaining[node] == 0) return;
+    const KdNode* kd = &tree->nodes[node];
+    Point origin = tree->points[from];
 
-    free_distances(distances, num_points);
-    TourResult result = {best_tour, shortest_dist};
-    return result;
+    if (kd->left < 0) {
+        for (int p = kd->lo; p < kd->hi; p++) {
+            int j = tree->perm[p];
+            if (j == from || (visited && visited[j])) continue;
+            Neighbor candidate = {j, tree->distance(origin, tree->points[j])};
+            insert_neighbor(best, count, k, candidate);
+        }
+        return;
+    }
+
+    double diff = point_coord(origin, kd->dim) - kd->split;
+    int near = diff < 0 ? kd->left : kd->right;
+    int far = diff < 0 ? kd->right : kd->left;
+    kd_search(tree, near, remaining, visited, from, k, best, count);
+    // Distances are rounded, so a point up to half a unit further can still tie.
+    double reach = *count < k ? 0 : (best[k - 1].distance + 0.5) * tree->reach_scale;
+    if (*count < k || diff * diff <= reach * reach) {
+        kd_search(tree, far, remaining, visited, from, k, best, count);
+    }
 }
 
-int main() {
-    int num_points;
-    Point* tsp_points = parse_tsp_file(FILEPATH, &num_points);
-    if (!tsp_points) {
+// Keeps best sorted with compare_neighbors and at most k long.
+void insert_neighbor(Neighbor* best, int* count, int k, Neighbor candidate) {
+    if (*count == k && compare_neighbors(&candidate, &best[k - 1]) >= 0) return;
+    int slot = *count < k ? (*count)++ : k - 1;
+    while (slot > 0 && compare_neighbors(&candidate, &best[slot - 1]) < 0) {
+        best[slot] = best[slot - 1];
+        slot--;
+    }
+    best[slot] = candidate;
+}
+
+// Top-k selection over a whole row, for GEO and EXPLICIT instances.
+void select_nearest(const Instance* instance, int from, int k, Neighbor* best) {
+    int count = 0;
+    for (int j = 0; j < instance->n; j++) {
+        if (j == from) continue;
+        Neighbor candidate = {j, instance_distance(instance, from, j)};
+        insert_neighbor(best, &count, k, candidate);
+    }
+}
+
+void kd_remove(const KdTree* tree, int* remaining, int point) {
+    for (int node = tree->leaf_of[point]; node >= 0; node = tree->nodes[node].parent) {
+        remaining[node]--;
+    }
+}
+
+void free_kd_tree(KdTree* tree) {
+    free(tree->perm);
+    free(tree->leaf_of);
+    free(tree->nodes);
+}
+
+// Distance along the Hilbert curve that fills the 2^HILBERT_BITS grid, for a
+// cell (x, y) of that grid.
+uint64_t hilbert_key(uint32_t x, uint32_t y) {
+    uint32_t side = 1u << HILBERT_BITS;
+    uint64_t key = 0;
+    for (uint32_t s = side / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0, ry = (y & s) > 0;
+        key += (uint64_t)s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = side - 1 - x;
+                y = side - 1 - y;
+            }
+            uint32_t temp = x;
+            x = y;
+            y = temp;
+        }
+    }
+    return key;
+}
+
+// Node order along a Hilbert curve over the bounding box: order[i] is the
+// node that becomes node i. Nodes close in the plane get close IDs, so the
+// matrix rows and tour entries touched by a local move share cache lines.
+int* hilbert_order(const Point* points, int n) {
+    double min_x = points[0].x, max_x = points[0].x, min_y = points[0].y, max_y = points[0].y;
+    for (int i = 1; i < n; i++) {
+        if (points[i].x < min_x) min_x = points[i].x;
+        if (points[i].x > max_x) max_x = points[i].x;
+        if (points[i].y < min_y) min_y = points[i].y;
+        if (points[i].y > max_y) max_y = points[i].y;
+    }
+    double range = max_x - min_x > max_y - min_y ? max_x - min_x : max_y - min_y;
+    double scale = range > 0 ? ((1u << HILBERT_BITS) - 1) / range : 0;
+
+    CurvePoint* curve = malloc(n * sizeof(CurvePoint));
+    for (int i = 0; i < n; i++) {
+        curve[i].key = hilbert_key((uint32_t)((points[i].x - min_x) * scale), (uint32_t)((points[i].y - min_y) * scale));
+        curve[i].node = i;
+    }
+    qsort(curve, n, sizeof(CurvePoint), compare_curve_points);
+
+    int* order = malloc(n * sizeof(int));
+    for (int i = 0; i < n; i++) order[i] = curve[i].node;
+    free(curve);
+    return order;
+}
+
+// Row i of the upper triangle: distances from i to i + 1, ..., n - 1.
+void fill_row_scalar(const Distances* distances, const Instance* instance, int i) {
+    size_t index = triangle_index(distances->n, i, i + 1);
+    for (int j = i + 1; j < distances->n; j++, index++) {
+        int dist = instance_distance(instance, i, j);
+        if (distances->narrow) ((uint16_t*)distances->triangle)[index] = dist;
+        else ((int32_t*)distances->triangle)[index] = dist;
+    }
+}
+
+#if HAVE_AVX2
+// Same row for EUC_2D or CEIL_2D, 4 distances per step. The operations are
+// those of euc_2d_distance and ceil_2d_distance, so the results are identical.
+__attribute__((target("avx2")))
+void fill_row_avx2(const Distances* distances, const double* xs, const double* ys, int i, bool ceiling) {
+    int n = distances->n;
+    size_t index = triangle_index(n, i, i + 1);
+    __m256d xi = _mm256_set1_pd(xs[i]), yi = _mm256_set1_pd(ys[i]);
+    int j = i + 1;
+    for (; j + 4 <= n; j += 4, index += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(&xs[j]), xi);
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(&ys[j]), yi);
+        __m256d dist = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)));
+        dist = ceiling ? _mm256_ceil_pd(dist) : _mm256_add_pd(dist, _mm256_set1_pd(0.5));
+        __m128i rounded = _mm256_cvttpd_epi32(dist);
+        if (distances->narrow) _mm_storel_epi64((__m128i*)&((uint16_t*)distances->triangle)[index], _mm_packus_epi32(rounded, rounded));
+        else _mm_storeu_si128((__m128i*)&((int32_t*)distances->triangle)[index], rounded);
+    }
+    for (; j < n; j++, index++) {
+        int dist = distances->distance(distances->points[i], distances->points[j]);
+        if (distances->narrow) ((uint16_t*)distances->triangle)[index] = dist;
+        else ((int32_t*)distances->triangle)[index] = dist;
+    }
+}
+#endif
+
+void* pre_process_worker(void* arg) {
+    PreProcessJob* job = arg;
+    STATS_START_THREAD("pre-process", PHASE_PREPROCESS);
+    int n = job->distances->n, k = job->candidates->k;
+    Neighbor* best = malloc((k + 1) * sizeof(Neighbor));
+    for (int i = job->id; i < n; i += job->num_threads) {
+        if (job->tree) {
+            int count = 0;
+            kd_search(job->tree, 0, NULL, NULL, i, k, best, &count);
+        } else {
+            select_nearest(job->instance, i, k, best);
+        }
+        for (int c = 0; c < k; c++) {
+            job->candidates->nodes[(size_t)i * k + c] = best[c].node;
+            job->candidates->distances[(size_t)i * k + c] = best[c].distance;
+        }
+        if (!job->distances->triangle) continue;
+#if HAVE_AVX2
+        if (job->avx2) {
+            fill_row_avx2(job->distances, job->xs, job->ys, i, job->ceiling);
+            continue;
+        }
+#endif
+        fill_row_scalar(job->distances, job->instance, i);
+    }
+    free(best);
+    STATS_FINISH_THREAD();
+    return NULL;
+}
+
+// Candidate lists come from k-d tree queries when there is a tree, and from
+// top-k selection over each row otherwise; neither sorts whole rows. The
+// matrix, when there is one, is filled row by row with the same threads.
+// EXPLICIT instances always get one, as there is nothing to compute from.
+Distances pre_process(const Instance* instance, const KdTree* tree, CandidateList* candidates, int num_threads) {
+    int num_points = instance->n;
+    const Point* points = instance->points;
+    Distances distances = {NULL, false, points, instance->distance, num_points};
+    int k = num_points - 1 < NUM_CANDIDATES ? num_points - 1 : NUM_CANDIDATES;
+    candidates->k = k;
+    candidates->nodes = malloc((size_t)num_points * k * sizeof(int));
+    candidates->distances = malloc((size_t)num_points * k * sizeof(int));
+
+    double* xs = NULL;
+    double* ys = NULL;
+    bool avx2 = false;
+    if (num_points <= MAX_MATRIX_NODES || !points) {
+        distances.narrow = instance->max_distance <= UINT16_MAX;
+
+        size_t count = (size_t)num_points * (num_points - 1) / 2;
+        size_t width = distances.narrow ? sizeof(uint16_t) : sizeof(int32_t);
+        size_t bytes = (count * width + sizeof(int32_t) + 63) / 64 * 64; // gathers read 4 bytes from the last entry
+        distances.triangle = aligned_alloc(64, bytes > 0 ? bytes : 64);
+
+#if HAVE_AVX2
+        bool rounded_euclidean = instance->distance == euc_2d_distance || instance->distance == ceil_2d_distance;
+        avx2 = USE_AVX2 && points && rounded_euclidean && __builtin_cpu_supports("avx2");
+#endif
+        if (avx2) {
+            xs = malloc(num_points * sizeof(double));
+            ys = malloc(num_points * sizeof(double));
+            for (int i = 0; i < num_points; i++) {
+                xs[i] = points[i].x;
+                ys[i] = points[i].y;
+            }
+        }
+    }
+
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    PreProcessJob* jobs = malloc(num_threads * sizeof(PreProcessJob));
+    for (int t = 0; t < num_threads; t++) {
+        jobs[t] = (PreProcessJob){instance, tree, candidates, &distances, xs, ys, avx2, instance->distance == ceil_2d_distance, num_threads, t};
+        pthread_create(&threads[t], NULL, pre_process_worker, &jobs[t]);
+    }
+    for (int t = 0; t < num_threads; t++) pthread_join(threads[t], NULL);
+    free(threads);
+    free(jobs);
+    free(xs);
+    free(ys);
+    return distances;
+}
+
+// Fills prep->work with the instance in Hilbert order when HILBERT_ORDER is
+// on; the candidate lists and matrix are left to pre_process.
+void renumber_instance(const Instance* instance, Prepared* prep) {
+    memset(prep, 0, sizeof(Prepared));
+    prep->work = *instance;
+    int n = instance->n;
+    if (!HILBERT_ORDER || !instance->points) return;
+    prep->original_id = hilbert_order(instance->points, n);
+    prep->renumbered = malloc(n * sizeof(int));
+    prep->work.points = malloc(n * sizeof(Point));
+    for (int i = 0; i < n; i++) {
+        prep->work.points[i] = instance->points[prep->original_id[i]];
+        prep->renumbered[prep->original_id[i]] = i;
+    }
+}
+
+// Reserves bytes at the next 64-byte boundary and returns their offset.
+uint64_t cache_place(uint64_t* offset, size_t bytes) {
+    uint64_t start = *offset;
+    *offset = (start + bytes + 63) / 64 * 64;
+    return start;
+}
+
+// The header this run would write for the instance: current settings, the
+// instance file's stamp and the resulting layout. Sizes follow pre_process.
+bool cache_layout(const char* source_path, const Instance* instance, CacheHeader* header) {
+    struct stat info;
+    if (stat(source_path, &info) < 0) return false;
+    int n = instance->n;
+    memset(header, 0, sizeof(CacheHeader));
+    memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+    header->version = CACHE_VERSION;
+    header->n = n;
+    header->source_size = info.st_size;
+    header->source_mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    header->k = n - 1 < NUM_CANDIDATES ? n - 1 : NUM_CANDIDATES;
+    header->hilbert_bits = HILBERT_ORDER && instance->points ? HILBERT_BITS : 0;
+    header->has_triangle = n <= MAX_MATRIX_NODES || !instance->points;
+    header->narrow = header->has_triangle && instance->max_distance <= UINT16_MAX;
+
+    uint64_t offset = sizeof(CacheHeader);
+    size_t count = (size_t)n * header->k;
+    if (instance->points) header->points_offset = cache_place(&offset, n * sizeof(Point));
+    if (header->hilbert_bits) header->original_id_offset = cache_place(&offset, n * sizeof(int));
+    header->nodes_offset = cache_place(&offset, count * sizeof(int));
+    header->distances_offset = cache_place(&offset, count * sizeof(int));
+    if (header->has_triangle) {
+        size_t width = header->narrow ? sizeof(uint16_t) : sizeof(int32_t);
+        header->triangle_offset = cache_place(&offset, (size_t)n * (n - 1) / 2 * width + sizeof(int32_t)); // room for the gathers, as in pre_process
+    }
+    header->size = offset;
+    return true;
+}
+
+bool cache_write(FILE* file, uint64_t offset, const void* data, size_t bytes) {
+    if (offset == 0 || bytes == 0) return true;
+    return fseeko(file, offset, SEEK_SET) == 0 && fwrite(data, 1, bytes, file) == bytes;
+}
+
+// Written under a temporary name and renamed, so concurrent runs on the same
+// instance never map a partial file.
+void save_cache(const char* cache_path, const char* source_path, const Instance* instance, const Prepared* prep) {
+    CacheHeader header;
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", cache_path, (int)getpid());
+    FILE* file = cache_layout(source_path, instance, &header) ? fopen(temp_path, "wb") : NULL;
+    if (!file) {
+        printf("Warning: Unable to write cache %s\n", cache_path);
+        return;
+    }
+    int n = instance->n;
+    size_t count = (size_t)n * header.k;
+    size_t width = header.narrow ? sizeof(uint16_t) : sizeof(int32_t);
+    bool ok = fwrite(&header, sizeof(CacheHeader), 1, file) == 1
+           && cache_write(file, header.points_offset, prep->work.points, n * sizeof(Point))
+           && cache_write(file, header.original_id_offset, prep->original_id, n * sizeof(int))
+           && cache_write(file, header.nodes_offset, prep->candidates.nodes, count * sizeof(int))
+           && cache_write(file, header.distances_offset, prep->candidates.distances, count * sizeof(int))
+           && cache_write(file, header.triangle_offset, prep->distances.triangle, (size_t)n * (n - 1) / 2 * width)
+           && fflush(file) == 0 && ftruncate(fileno(file), header.size) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp_path, cache_path) != 0) {
+        remove(temp_path);
+        printf("Warning: Unable to write cache %s\n", cache_path);
+        return;
+    }
+    LOG(LOG_SUMMARY, "Saved cache %s\n", cache_path);
+}
+
+// Maps the cache when its header matches the one this run would write, and
+// points prep at the arrays inside. Returns false, leaving prep untouched,
+// when there is no usable cache.
+bool load_cache(const char* cache_path, const char* source_path, const Instance* instance, Prepared* prep) {
+    CacheHeader header;
+    int fd = open(cache_path, O_RDONLY);
+    struct stat info;
+    if (fd < 0) return false;
+    if (!cache_layout(source_path, instance, &header) || fstat(fd, &info) < 0 || (uint64_t)info.st_size != header.size) {
+        close(fd);
+        return false;
+    }
+    char* data = mmap(NULL, header.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    if (memcmp(data, &header, sizeof(CacheHeader)) != 0) {
+        munmap(data, header.size);
+        return false;
+    }
+
+    int n = instance->n;
+    memset(prep, 0, sizeof(Prepared));
+    prep->work = *instance;
+    prep->mapping = data;
+    prep->mapping_size = header.size;
+    if (header.points_offset) prep->work.points = (Point*)(data + header.points_offset);
+    if (header.original_id_offset) {
+        prep->original_id = (int*)(data + header.original_id_offset);
+        prep->renumbered = malloc(n * sizeof(int));
+        for (int i = 0; i < n; i++) prep->renumbered[prep->original_id[i]] = i;
+    }
+    prep->candidates.k = header.k;
+    prep->candidates.nodes = (int*)(data + header.nodes_offset);
+    prep->candidates.distances = (int*)(data + header.distances_offset);
+    prep->distances = (Distances){NULL, header.narrow, prep->work.points, instance->distance, n};
+    if (header.triangle_offset) prep->distances.triangle = data + header.triangle_offset;
+    return true;
+}
+
+void free_prepared(Prepared* prep) {
+    free(prep->renumbered);
+    if (prep->mapping) {
+        munmap(prep->mapping, prep->mapping_size);
+    } else {
+        free_distances(&prep->distances);
+        free_candidates(&prep->candidates);
+        if (prep->original_id) free(prep->work.points);
+        free(prep->original_id);
+    }
+    memset(prep, 0, sizeof(Prepared));
+}
+
+int calculate_tour_length(const int* tour, int n, const Distances* distances) {
+    int length = 0;
+    for (int i = 0; i < n; i++) {
+        int current = tour[i];
+        int next = tour[(i + 1) % n];
+        length += get_distance(distances, current, next);
+    }
+    return length;
+}
+
+int calculate_tour_distance(const Instance* instance, const int* tour, int n) {
+    int total = 0;
+    for (int i = 0; i < n - 1; i++) {
+        total += instance_distance(instance, tour[i], tour[i + 1]);
+    }
+    total += instance_distance(instance, tour[n - 1], tour[0]);
+    return total;
+}
+
+// Reverses the tour between positions i and j (inclusive, wrapping around).
+// The shorter side is reversed since both give the same cycle.
+void reverse_segment(int* tour, int* pos, int n, int i, int j) {
+    int len = (j - i + n) % n + 1;
+    if (2 * len > n) {
+        int temp = i;
+        i = (j + 1) % n;
+        j = (temp - 1 + n) % n;
+        len = n - len;
+    }
+    for (int k = 0; k < len / 2; k++) {
+        int temp = tour[i];
+        tour[i] = tour[j];
+        tour[j] = temp;
+        pos[tour[i]] = i;
+        pos[tour[j]] = j;
+        i = (i + 1) % n;
+        j = (j - 1 + n) % n;
+    }
+}
+
+// Writes nodes into order and cuts it into segments of group_size nodes
+// (a single segment when the tour is a plain array).
+void tour_layout(Tour* t, const int* nodes) {
+    int n = t->n;
+    int size = t->two_level ? t->group_size : n;
+    if (nodes != t->order) memcpy(t->order, nodes, n * sizeof(int));
+    t->num_segments = 0;
+    for (int lo = 0; lo < n; lo += size) {
+        int s = t->num_segments++;
+        t->seg_lo[s] = lo;
+        t->seg_hi[s] = lo + size < n ? lo + size : n;
+        t->seg_reversed[s] = false;
+        t->seg_order[s] = s;
+        t->seg_rank[s] = s;
+        for (int i = lo; i < t->seg_hi[s]; i++) {
+            t->slot[t->order[i]] = i;
+            t->seg[t->order[i]] = s;
+        }
+    }
+}
+
+void tour_init(Tour* t, const int* nodes, int n) {
+    t->n = n;
+    t->two_level = n >= TWO_LEVEL_MIN_NODES;
+    t->group_size = t->two_level ? (int)sqrt(n) : n;
+    int ideal = (n + t->group_size - 1) / t->group_size;
+    t->max_segments = t->two_level ? 4 * ideal + 4 : 1;
+    t->order = malloc(n * sizeof(int));
+    t->slot = malloc(n * sizeof(int));
+    t->seg = malloc(n * sizeof(int));
+    t->scratch = t->two_level ? malloc(n * sizeof(int)) : NULL;
+    t->seg_lo = malloc(t->max_segments * sizeof(int));
+    t->seg_hi = malloc(t->max_segments * sizeof(int));
+    t->seg_reversed = malloc(t->max_segments * sizeof(bool));
+    t->seg_order = malloc(t->max_segments * sizeof(int));
+    t->seg_rank = malloc(t->max_segments * sizeof(int));
+    STATS_ADD(allocations, t->two_level ? 9 : 8);
+    tour_layout(t, nodes);
+}
+
+void tour_free(Tour* t) {
+    free(t->order);
+    free(t->slot);
+    free(t->seg);
+    free(t->scratch);
+    free(t->seg_lo);
+    free(t->seg_hi);
+    free(t->seg_reversed);
+    free(t->seg_order);
+    free(t->seg_rank);
+}
+
+int segment_first(const Tour* t, int s) {
+    return t->seg_reversed[s] ? t->order[t->seg_hi[s] - 1] : t->order[t->seg_lo[s]];
+}
+
+int segment_last(const Tour* t, int s) {
+    return t->seg_reversed[s] ? t->order[t->seg_lo[s]] : t->order[t->seg_hi[s] - 1];
+}
+
+int tour_next(const Tour* t, int node) {
+    int s = t->seg[node], i = t->slot[node];
+    if (!t->seg_reversed[s]) {
+        if (i + 1 < t->seg_hi[s]) return t->order[i + 1];
+    } else if (i > t->seg_lo[s]) {
+        return t->order[i - 1];
+    }
+    return segment_first(t, t->seg_order[(t->seg_rank[s] + 1) % t->num_segments]);
+}
+
+int tour_prev(const Tour* t, int node) {
+    int s = t->seg[node], i = t->slot[node];
+    if (!t->seg_reversed[s]) {
+        if (i > t->seg_lo[s]) return t->order[i - 1];
+    } else if (i + 1 < t->seg_hi[s]) {
+        return t->order[i + 1];
+    }
+    return segment_last(t, t->seg_order[(t->seg_rank[s] - 1 + t->num_segments) % t->num_segments]);
+}
+
+long long tour_position(const Tour* t, int node) {
+    int s = t->seg[node];
+    int offset = t->seg_reversed[s] ? t->seg_hi[s] - 1 - t->slot[node] : t->slot[node] - t->seg_lo[s];
+    return (long long)t->seg_rank[s] * t->n + offset;
+}
+
+// True when b lies on the path that goes forward from a to c.
+bool tour_between(const Tour* t, int a, int b, int c) {
+    long long pa = tour_position(t, a), pb = tour_position(t, b), pc = tour_position(t, c);
+    if (pa <= pc) return pa <= pb && pb <= pc;
+    return pb >= pa || pb <= pc;
+}
+
+// Cuts segment s into order[lo..m) and order[m..hi). The smaller half becomes a
+// new segment, so relabeling costs O(sqrt(n)).
+void tour_split(Tour* t, int s, int m) {
+    int lo = t->seg_lo[s], hi = t->seg_hi[s];
+    bool lower_first = !t->seg_reversed[s];
+    int ns = t->num_segments++;
+    bool new_first;
+    if (m - lo <= hi - m) {
+        t->seg_lo[ns] = lo;
+        t->seg_hi[ns] = m;
+        t->seg_lo[s] = m;
+        new_first = lower_first;
+    } else {
+        t->seg_lo[ns] = m;
+        t->seg_hi[ns] = hi;
+        t->seg_hi[s] = m;
+        new_first = !lower_first;
+    }
+    t->seg_reversed[ns] = t->seg_reversed[s];
+    for (int i = t->seg_lo[ns]; i < t->seg_hi[ns]; i++) t->seg[t->order[i]] = ns;
+
+    int r = t->seg_rank[s] + (new_first ? 0 : 1);
+    memmove(&t->seg_order[r + 1], &t->seg_order[r], (t->num_segments - 1 - r) * sizeof(int));
+    t->seg_order[r] = ns;
+    for (int i = r; i < t->num_segments; i++) t->seg_rank[t->seg_order[i]] = i;
+}
+
+// Reverses the path from `from` to `to` by moving nodes when both lie in the
+// same segment and the path does not leave it. Returns false otherwise.
+bool reverse_in_segment(Tour* t, int from, int to) {
+    int s = t->seg[from];
+    if (t->seg[to] != s) return false;
+    int i = t->slot[from], j = t->slot[to];
+    if (t->seg_reversed[s]) {
+        int temp = i;
+        i = j;
+        j = temp;
+    }
+    if (i > j) return false;
+    for (; i < j; i++, j--) {
+        int temp = t->order[i];
+        t->order[i] = t->order[j];
+        t->order[j] = temp;
+        t->slot[t->order[i]] = i;
+        t->slot[t->order[j]] = j;
+    }
+    return true;
+}
+
+// Reverses the path that goes forward from `from` to `to`.
+void tour_reverse_path(Tour* t, int from, int to) {
+    if (from == to) return;
+    if (!t->two_level) {
+        reverse_segment(t->order, t->slot, t->n, t->slot[from], t->slot[to]);
+        return;
+    }
+    // Most 2-opt paths are short: reverse them in place when they lie inside a
+    // single segment, either the path itself or its complement.
+    int next_to = tour_next(t, to), prev_from = tour_prev(t, from);
+    if (reverse_in_segment(t, from, to) || reverse_in_segment(t, next_to, prev_from)) return;
+    if (t->num_segments + 2 > t->max_segments) {
+        tour_to_array(t, t->scratch);
+        tour_layout(t, t->scratch);
+    }
+
+    int s = t->seg[from];
+    if (segment_first(t, s) != from) tour_split(t, s, t->slot[from] + (t->seg_reversed[s] ? 1 : 0));
+    s = t->seg[to];
+    if (segment_last(t, s) != to) tour_split(t, s, t->slot[to] + (t->seg_reversed[s] ? 0 : 1));
+
+    // from now starts a segment and to ends one, so the path is a run of whole
+    // segments. Reversing the complementary run instead gives the same cycle.
+    int num = t->num_segments;
+    int first = t->seg_rank[t->seg[from]], last = t->seg_rank[t->seg[to]];
+    int count = (last - first + num) % num + 1;
+    if (2 * count > num) {
+        int temp = first;
+        first = (last + 1) % num;
+        last = (temp - 1 + num) % num;
+        count = num - count;
+    }
+    for (int k = 0, i = first, j = last; k < count / 2; k++) {
+        int temp = t->seg_order[i];
+        t->seg_order[i] = t->seg_order[j];
+        t->seg_order[j] = temp;
+        i = (i + 1) % num;
+        j = (j - 1 + num) % num;
+    }
+    for (int k = 0, i = first; k < count; k++, i = (i + 1) % num) {
+        int seg = t->seg_order[i];
+        t->seg_reversed[seg] = !t->seg_reversed[seg];
+        t->seg_rank[seg] = i;
+    }
+}
+
+// Exchanges the places of nodes u and v.
+void tour_swap(Tour* t, int u, int v) {
+    int slot_u = t->slot[u], seg_u = t->seg[u];
+    t->order[t->slot[v]] = u;
+    t->order[slot_u] = v;
+    t->slot[u] = t->slot[v];
+    t->slot[v] = slot_u;
+    t->seg[u] = t->seg[v];
+    t->seg[v] = seg_u;
+}
+
+void tour_to_array(const Tour* t, int* out) {
+    int k = 0;
+    for (int r = 0; r < t->num_segments; r++) {
+        int s = t->seg_order[r];
+        if (t->seg_reversed[s]) {
+            for (int i = t->seg_hi[s] - 1; i >= t->seg_lo[s]; i--) out[k++] = t->order[i];
+        } else {
+            memcpy(&out[k], &t->order[t->seg_lo[s]], (t->seg_hi[s] - t->seg_lo[s]) * sizeof(int));
+            k += t->seg_hi[s] - t->seg_lo[s];
+        }
+    }
+}
+
+void init_tour_state(TourState* state, const int* tour, int n) {
+    state->n = n;
+    tour_init(&state->tour, tour, n);
+    state->queue = malloc(n * sizeof(int));
+    state->queued = calloc(n, sizeof(bool));
+    state->head = 0;
+    state->queue_size = 0;
+    state->log_capacity = 4 * n;
+    state->log = malloc(state->log_capacity * sizeof(int));
+    state->log_size = 0;
+    state->budget = NULL;
+    STATS_ADD(allocations, 3);
+}
+
+// Starts a new search on tour with the buffers of a previous one.
+void reset_tour_state(TourState* state, const int* tour) {
+    tour_layout(&state->tour, tour);
+    memset(state->queued, 0, state->n * sizeof(bool));
+    state->head = 0;
+    state->queue_size = 0;
+    state->log_size = 0;
+    state->budget = NULL;
+}
+
+void free_tour_state(TourState* state) {
+    tour_free(&state->tour);
+    free(state->queue);
+    free(state->queued);
+    free(state->log);
+}
+
+void init_run_arena(RunArena* arena, int n, const KdTree* tree) {
+    arena->initial_tour = malloc(n * sizeof(int));
+    arena->worsened_tour = malloc(n * sizeof(int));
+    arena->visited = malloc(n * sizeof(bool));
+    arena->remaining = tree ? malloc(tree->num_nodes * sizeof(int)) : NULL;
+    arena->result = malloc(n * sizeof(int));
+    STATS_ADD(allocations, tree ? 5 : 4);
+    for (int i = 0; i < n; i++) arena->initial_tour[i] = i;
+    init_tour_state(&arena->state, arena->initial_tour, n);
+}
+
+void free_run_arena(RunArena* arena) {
+    free_tour_state(&arena->state);
+    free(arena->initial_tour);
+    free(arena->worsened_tour);
+    free(arena->visited);
+    free(arena->remaining);
+    free(arena->result);
+}
+
+void push_node(TourState* state, int node) {
+    if (state->queued[node]) return;
+    state->queue[(state->head + state->queue_size) % state->n] = node;
+    state->queued[node] = true;
+    state->queue_size++;
+}
+
+// Replaces edges (a, b) and (c, d), where b follows a and d follows c, with (a, c) and (b, d).
+void apply_two_opt(TourState* state, int a, int b, int c, int d) {
+    if (state->log_size + 4 > state->log_capacity) {
+        state->log_capacity *= 2;
+        state->log = realloc(state->log, state->log_capacity * sizeof(int));
+        STATS_ADD(allocations, 1);
+    }
+    STATS_ADD(moves_applied, 1);
+    state->log[state->log_size++] = a;
+    state->log[state->log_size++] = b;
+    state->log[state->log_size++] = c;
+    state->log[state->log_size++] = d;
+    tour_reverse_path(&state->tour, b, c);
+}
+
+// Replaces edges (a, b) and (c, d) by (a, c) and (b, d), where b follows a
+// exactly when d follows c.
+void two_opt_move(TourState* state, int a, int b, int c, int d) {
+    if (tour_next(&state->tour, a) == b) apply_two_opt(state, a, b, c, d);
+    else apply_two_opt(state, b, a, d, c);
+}
+
+// Moves the segment a..e, found between p and f, between c1 and c2. All pairs
+// are given in the same direction of travel (p, a, ..., e, f and c1, c2). The
+// segment arrives as c1, e..a, c2 when reversed and as c1, a..e, c2 otherwise.
+// This is a 3-opt move, made of up to three logged 2-opt moves.
+void apply_or_opt(TourState* state, int p, int a, int e, int f, int c1, int c2, bool reversed) {
+    if (c2 == p) {
+        // Walk the other way round, otherwise the first 2-opt would share p.
+        apply_or_opt(state, f, e, a, p, c2, c1, reversed);
+        return;
+    }
+    two_opt_move(state, p, a, c1, c2); // p c1 ... f e..a c2
+    if (c1 != f) two_opt_move(state, p, c1, f, e); // p f ... c1 e..a c2
+    if (!reversed && a != e) two_opt_move(state, c1, e, a, c2); // c1 a..e c2
+}
+
+// Undoes logged moves newest first until only the first keep entries are
+// left. Either path between the new edges can be reversed back, depending on
+// which way round the tour now runs.
+void undo_moves(TourState* state, int keep) {
+    while (state->log_size > keep) {
+        state->log_size -= 4;
+        int* move = &state->log[state->log_size];
+        int a = move[0], b = move[1], c = move[2], d = move[3];
+        if (tour_next(&state->tour, a) == c) tour_reverse_path(&state->tour, c, b);
+        else tour_reverse_path(&state->tour, a, d);
+    }
+}
+
+// Change in tour length from exchanging the places of nodes u and v.
+int swap_delta(const Distances* distances, const Tour* tour, int u, int v) {
+    STATS_ADD(moves_evaluated, 1);
+    int prev_u = tour_prev(tour, u), next_u = tour_next(tour, u);
+    int prev_v = tour_prev(tour, v), next_v = tour_next(tour, v);
+    if (next_u == v || next_v == u) {
+        int p = next_u == v ? prev_u : prev_v, first = next_u == v ? u : v;
+        int second = next_u == v ? v : u, q = next_u == v ? next_v : next_u;
+        if (p == second) return 0;
+        return get_distance(distances, p, second) + get_distance(distances, first, q)
+             - get_distance(distances, p, first) - get_distance(distances, second, q);
+    }
+    return get_distance(distances, prev_u, v) + get_distance(distances, v, next_u)
+         + get_distance(distances, prev_v, u) + get_distance(distances, u, next_v)
+         - get_distance(distances, prev_u, u) - get_distance(distances, u, next_u)
+         - get_distance(distances, prev_v, v) - get_distance(distances, v, next_v);
+}
+
+// Tries to move a segment of up to OR_OPT_MAX_SEGMENT nodes that starts at a
+// and runs in either direction. Taking it out gains
+// d(p, a) + d(e, f) - d(p, f); it is put back next to a candidate neighbor of
+// one of its ends, so candidates at least that far away are not looked at.
+// Makes the first improving move and returns its change in length, else 0.
+int or_opt_move(const Distances* distances, const CandidateList* candidates, TourState* state, int a) {
+    const Tour* tour = &state->tour;
+    if (state->n < 2 * OR_OPT_MAX_SEGMENT + 2) return 0;
+
+    for (int dir = 0; dir < 2; dir++) {
+        int e = a;
+        int p = dir == 0 ? tour_prev(tour, a) : tour_next(tour, a);
+        for (int len = 1; len <= OR_OPT_MAX_SEGMENT; len++) {
+            if (len > 1) e = dir == 0 ? tour_next(tour, e) : tour_prev(tour, e);
+            if (dir == 1 && len == 1) continue; // same segment as dir 0
+            int f = dir == 0 ? tour_next(tour, e) : tour_prev(tour, e);
+            int gain = get_distance(distances, p, a) + get_distance(distances, e, f) - get_distance(distances, p, f);
+            if (gain <= 0) continue;
+
+            for (int end = 0; end < (len == 1 ? 1 : 2); end++) {
+                int x = end == 0 ? a : e, y = end == 0 ? e : a;
+                for (int k = 0; k < candidates->k; k++) {
+                    int c = candidates->nodes[x * candidates->k + k];
+                    int dist_xc = candidates->distances[x * candidates->k + k];
+                    if (dist_xc >= gain) break;
+                    bool inside = false;
+                    for (int s = a, i = 0; i < len; i++, s = dir == 0 ? tour_next(tour, s) : tour_prev(tour, s)) {
+                        if (s == c) inside = true;
+                    }
+                    if (inside) continue;
+
+                    // x goes next to c, either after it (side 0) or before it.
+                    for (int side = 0; side < 2; side++) {
+                        int c1 = side == 0 ? c : (dir == 0 ? tour_prev(tour, c) : tour_next(tour, c));
+                        int c2 = side == 0 ? (dir == 0 ? tour_next(tour, c) : tour_prev(tour, c)) : c;
+                        int other = side == 0 ? c2 : c1;
+                        if (other == a || other == e) continue; // (p, a) or (e, f) itself
+                        int delta = dist_xc + get_distance(distances, y, other) - get_distance(distances, c1, c2) - gain;
+                        STATS_ADD(moves_evaluated, 1);
+                        if (delta < 0) {
+                            apply_or_opt(state, p, a, e, f, c1, c2, (side == 0) == (x == e));
+                            push_node(state, p);
+                            push_node(state, a);
+                            push_node(state, e);
+                            push_node(state, f);
+                            push_node(state, c1);
+                            push_node(state, c2);
+                            return delta;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Neighbor list 2-opt and Or-opt: only edges to candidate nodes are tried,
+// and a node is only looked at again (don't-look bit cleared) when one of its
+// edges changes. Or-opt is tried once a node has no improving 2-opt move.
+// Runs until the queue is empty and returns the change in tour length.
+int or2opt_local(const Distances* distances, const CandidateList* candidates, TourState* state) {
+    const Tour* tour = &state->tour;
+    int n = state->n;
+    int total_delta = 0;
+    STATS_PHASE(PHASE_TWO_OPT);
+
+    for (int steps = 1; state->queue_size > 0; steps++) {
+        if (steps % 256 == 0 && budget_spent(state->budget, INT_MAX)) break;
+        int a = state->queue[state->head];
+        state->head = (state->head + 1) % n;
+        state->queue_size--;
+        state->queued[a] = false;
+
+        bool improved = false;
+        for (int dir = 0; dir < 2 && !improved; dir++) {
+            int b = dir == 0 ? tour_next(tour, a) : tour_prev(tour, a);
+            int dist_ab = get_distance(distances, a, b);
+            for (int k = 0; k < candidates->k; k++) {
+                int c = candidates->nodes[a * candidates->k + k];
+                int dist_ac = candidates->distances[a * candidates->k + k];
+                if (dist_ac >= dist_ab) break;
+                int d = dir == 0 ? tour_next(tour, c) : tour_prev(tour, c);
+                if (c == b || d == a) continue;
+                int delta = dist_ac + get_distance(distances, b, d) - dist_ab - get_distance(distances, c, d);
+                STATS_ADD(moves_evaluated, 1);
+                if (delta < 0) {
+                    if (dir == 0) apply_two_opt(state, a, b, c, d);
+                    else apply_two_opt(state, b, a, d, c);
+                    total_delta += delta;
+                    push_node(state, a);
+                    push_node(state, b);
+                    push_node(state, c);
+                    push_node(state, d);
+                    improved = true;
+                    break;
+                }
+            }
+        }
+        if (!improved) total_delta += or_opt_move(distances, candidates, state, a);
+    }
+    STATS_END_PHASE();
+    return total_delta;
+}
+
+TourResult two_opt_swap(const Distances* distances, const CandidateList* candidates, RunArena* arena, const int* initial_tour, int n) {
+    TourState* state = &arena->state;
+    reset_tour_state(state, initial_tour);
+    for (int i = 0; i < n; i++) push_node(state, initial_tour[i]);
+    int shortest_dist = calculate_tour_length(initial_tour, n, distances);
+    shortest_dist += or2opt_local(distances, candidates, state);
+
+    TourResult result = {arena->result, shortest_dist};
+    tour_to_array(&state->tour, result.tour);
+    return result;
+}
+
+// Same four-edge delta as two_opt_swap, but accepts moves that make the tour longer.
+int longer_scan_scalar(const Distances* distances, const int* tour, int n, int i, int from) {
+    int a = tour[i], b = tour[i + 1];
+    int ab = get_distance(distances, a, b);
+    for (int j = from; j < n; j++) {
+        int c = tour[j], d = tour[(j + 1) % n];
+        STATS_ADD(moves_evaluated, 1);
+        if (get_distance(distances, a, c) + get_distance(distances, b, d) - ab - get_distance(distances, c, d) > 0) return j;
+    }
+    return n;
+}
+
+#if HAVE_AVX2
+// Distances between x[k] and y[k], x[k] != y[k], for 8 pairs at once.
+__attribute__((target("avx2")))
+__m256i gather_distances(const Distances* distances, __m256i x, __m256i y) {
+    __m256i lo = _mm256_min_epi32(x, y), hi = _mm256_max_epi32(x, y);
+    __m256i row = _mm256_srli_epi32(_mm256_mullo_epi32(lo, _mm256_sub_epi32(_mm256_set1_epi32(2 * distances->n - 1), lo)), 1);
+    __m256i index = _mm256_add_epi32(row, _mm256_sub_epi32(hi, _mm256_add_epi32(lo, _mm256_set1_epi32(1))));
+    if (distances->narrow) {
+        __m256i words = _mm256_i32gather_epi32((const int*)distances->triangle, index, 2);
+        return _mm256_and_si256(words, _mm256_set1_epi32(0xFFFF));
+    }
+    return _mm256_i32gather_epi32((const int*)distances->triangle, index, 4);
+}
+
+// Scores 8 consecutive j per step and leaves the last few to the scalar loop.
+__attribute__((target("avx2")))
+int longer_scan_avx2(const Distances* distances, const int* tour, int n, int i, int from) {
+    int a = tour[i], b = tour[i + 1];
+    __m256i va = _mm256_set1_epi32(a), vb = _mm256_set1_epi32(b);
+    __m256i ab = _mm256_set1_epi32(get_distance(distances, a, b));
+    int j = from;
+    for (; j + 8 < n; j += 8) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)&tour[j]);
+        __m256i d = _mm256_loadu_si256((const __m256i*)&tour[j + 1]);
+        __m256i added = _mm256_add_epi32(gather_distances(distances, va, c), gather_distances(distances, vb, d));
+        __m256i removed = _mm256_add_epi32(ab, gather_distances(distances, c, d));
+        __m256i longer = _mm256_cmpgt_epi32(_mm256_sub_epi32(added, removed), _mm256_setzero_si256());
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(longer));
+        STATS_ADD(moves_evaluated, 8);
+        STATS_ADD(distance_lookups, 24);
+        if (mask) return j + __builtin_ctz(mask);
+    }
+    return longer_scan_scalar(distances, tour, n, i, j);
+}
+#endif
+
+// The AVX2 scan needs a matrix whose indices fit in 32 bits.
+ScanFunction select_scan(int n) {
+#if HAVE_AVX2
+    if (USE_AVX2 && n <= 46340 && __builtin_cpu_supports("avx2")) return longer_scan_avx2;
+#endif
+    return longer_scan_scalar;
+}
+
+// Writes the worsened copy of initial_tour into tour.
+void two_opt_reverse(const Distances* distances, const int* initial_tour, int* tour, int n) {
+    int* best_tour = tour;
+    memcpy(best_tour, initial_tour, n * sizeof(int));
+    ScanFunction scan = select_scan(n);
+    bool improved = true;
+
+    while (improved) {
+        improved = false;
+        for (int i = 0; i < n - 1; i++) {
+            for (int j = scan(distances, best_tour, n, i, i + 2); j < n; j = scan(distances, best_tour, n, i, j + 1)) {
+                for (int k = 0; k < (j - i) / 2; k++) {
+                    int temp = best_tour[i + 1 + k];
+                    best_tour[i + 1 + k] = best_tour[j - k];
+                    best_tour[j - k] = temp;
+                }
+                STATS_ADD(moves_applied, 1);
+                improved = true;
+            }
+        }
+    }
+}
+
+// Step between the nodes perturbed one after another. Renumbered nodes that
+// are close in ID are close in the plane, and perturbing them in a row
+// re-optimizes the same area over and over, so the loop jumps by a step
+// coprime with n instead and still visits every node once.
+int perturbation_stride(int n) {
+    if (!HILBERT_ORDER || n < 3) return 1;
+    int stride = (int)(n * 0.618) | 1;
+    for (;; stride += 2) {
+        int a = n, b = stride;
+        while (b) {
+            int temp = a % b;
+            a = b;
+            b = temp;
+        }
+        if (a == 1) return stride;
+    }
+}
+
+// Each node swap is scored in O(1), then only the edges around the swapped
+// nodes are re-optimized. Swaps that end up longer are undone. Sideways swaps
+// are kept and the scan goes on after an improvement: rolling them back or
+// restarting the scan gains 0.2% on xqg237 in a single run but loses 0.2-0.8%
+// on xit1083 (benchmark.py).
+// Gives up and returns the current tour if a perturbation round ends above abandon_above.
+// In implicit mode the O(n^2) two_opt_reverse phase is skipped and each node is
+// only swapped with its candidate neighbors. A warm initial_tour, read from a
+// tour file, is good already and skips it too.
+TourResult two_opt_and_swap(const Distances* distances, const CandidateList* candidates, RunArena* arena, const int* initial_tour, int n, int abandon_above, const Budget* budget, bool warm) {
+    bool implicit = distances->triangle == NULL;
+    const int* start_tour = initial_tour;
+    if (!implicit && !warm) {
+        double reverse_start = wall_time();
+        STATS_PHASE(PHASE_REVERSE);
+        two_opt_reverse(distances, initial_tour, arena->worsened_tour, n);
+        STATS_END_PHASE();
+        LOG(LOG_DEBUG, "Reverse phase: %.3f seconds\n", wall_time() - reverse_start);
+        start_tour = arena->worsened_tour;
+    }
+    TourState* state = &arena->state;
+    reset_tour_state(state, start_tour);
+    state->budget = budget;
+    for (int i = 0; i < n; i++) push_node(state, start_tour[i]);
+    int shortest_dist = calculate_tour_length(start_tour, n, distances);
+    shortest_dist += or2opt_local(distances, candidates, state);
+    state->log_size = 0;
+    bool improved = true;
+    int stride = perturbation_stride(n);
+    STATS_PHASE(PHASE_PERTURB);
+
+    while (improved) {
+        improved = false;
+        for (int i = 0, u = 0; i < n; i++, u = (int)(((long long)u + stride) % n)) {
+            if (budget_spent(budget, shortest_dist)) break;
+            int num_partners = implicit ? candidates->k : n - 1 - u;
+            for (int p = 0; p < num_partners; p++) {
+                int v = implicit ? candidates->nodes[u * candidates->k + p] : u + 1 + p;
+                int delta = swap_delta(distances, &state->tour, u, v);
+                tour_swap(&state->tour, u, v);
+                STATS_ADD(moves_applied, 1);
+                push_node(state, u);
+                push_node(state, v);
+                push_node(state, tour_prev(&state->tour, u));
+                push_node(state, tour_next(&state->tour, u));
+                push_node(state, tour_prev(&state->tour, v));
+                push_node(state, tour_next(&state->tour, v));
+                delta += or2opt_local(distances, candidates, state);
+                if (delta <= 0) {
+                    shortest_dist += delta;
+                    state->log_size = 0;
+                    if (delta == 0) continue; // keep sideways moves, they let the search drift
+                    improved = true;
+                    LOG(LOG_PROGRESS, "2-opt improvement: %d\n", shortest_dist);
+                } else {
+                    undo_moves(state, 0);
+                    tour_swap(&state->tour, u, v);
+                }
+            }
+        }
+        if (shortest_dist > abandon_above) break;
+    }
+    STATS_END_PHASE();
+
+    TourResult result = {arena->result, shortest_dist};
+    tour_to_array(&state->tour, result.tour);
+    return result;
+}
+
+// True when the edge (a, b) is one of the num_edges pairs in edges.
+bool lk_tabu(const int* edges, int num_edges, int a, int b) {
+    for (int i = 0; i < num_edges; i++) {
+        int x = edges[2 * i], y = edges[2 * i + 1];
+        if ((x == a && y == b) || (x == b && y == a)) return true;
+    }
+    return false;
+}
+
+// One Lin-Kernighan step from t1, made of sequential 2-opt moves. The edge
+// (t1, t2) is kept open: each move adds (t2, t3) for a candidate t3, removes
+// (t3, t4) and makes t4 the new t2, as long as the gain without the closing
+// edge stays positive. The first level tries every candidate, deeper levels
+// take the one that looks best one move ahead. Added edges are never removed
+// and removed edges never added back. The chain is cut back to its best
+// closed tour; returns that gain, or 0 after undoing everything.
+int lk_step(const Distances* distances, const CandidateList* candidates, TourState* state, int t1) {
+    const Tour* tour = &state->tour;
+    int k = candidates->k;
+    int added[2 * LK_MAX_DEPTH], removed[2 * (LK_MAX_DEPTH + 1)];
+    int mark = state->log_size;
+
+    for (int dir = 0; dir < 2; dir++) {
+        int first_t2 = dir == 0 ? tour_next(tour, t1) : tour_prev(tour, t1);
+        for (int first = 0; first < k; first++) {
+            int t2 = first_t2;
+            int gain = get_distance(distances, t1, t2);
+            int best_gain = 0, best_size = mark;
+            int num_added = 0, num_removed = 1;
+            removed[0] = t1;
+            removed[1] = t2;
+
+            for (int depth = 0; depth < LK_MAX_DEPTH; depth++) {
+                bool t2_after = tour_next(tour, t1) == t2;
+                int t3 = -1, t4 = -1, best_look = INT_MIN;
+                for (int j = depth == 0 ? first : 0; j < (depth == 0 ? first + 1 : k); j++) {
+                    int c = candidates->nodes[t2 * k + j];
+                    int g1 = gain - candidates->distances[t2 * k + j];
+                    if (g1 <= 0) break;
+                    if (c == t1) continue;
+                    int d = t2_after ? tour_prev(tour, c) : tour_next(tour, c);
+                    if (d == t2) continue;
+                    if (lk_tabu(removed, num_removed, t2, c) || lk_tabu(added, num_added, c, d)) continue;
+                    int look = g1 + get_distance(distances, c, d);
+                    STATS_ADD(moves_evaluated, 1);
+                    if (look > best_look) {
+                        best_look = look;
+                        t3 = c;
+                        t4 = d;
+                    }
+                }
+                if (t3 < 0) break;
+
+                two_opt_move(state, t1, t2, t4, t3);
+                added[2 * num_added] = t2;
+                added[2 * num_added++ + 1] = t3;
+                removed[2 * num_removed] = t3;
+                removed[2 * num_removed++ + 1] = t4;
+                gain = best_look;
+                int closed = gain - get_distance(distances, t4, t1);
+                if (closed > best_gain) {
+                    best_gain = closed;
+                    best_size = state->log_size;
+                }
+                t2 = t4;
+            }
+
+            undo_moves(state, best_size);
+            if (best_gain > 0) {
+                for (int i = mark; i < best_size; i++) push_node(state, state->log[i]);
+                return best_gain;
+            }
+        }
+    }
+    return 0;
+}
+
+// Runs Lin-Kernighan steps from every node in the don't-look-bit queue, with
+// Or-opt as a fallback for nodes without an improving chain. Returns the
+// change in tour length.
+int lk_local(const Distances* distances, const CandidateList* candidates, TourState* state) {
+    int n = state->n;
+    int total_delta = 0;
+    STATS_PHASE(PHASE_TWO_OPT);
+
+    for (int steps = 1; state->queue_size > 0; steps++) {
+        if (steps % 256 == 0 && budget_spent(state->budget, INT_MAX)) break;
+        int a = state->queue[state->head];
+        state->head = (state->head + 1) % n;
+        state->queue_size--;
+        state->queued[a] = false;
+
+        int gain = lk_step(distances, candidates, state, a);
+        if (gain > 0) {
+            total_delta -= gain;
+            push_node(state, a);
+        } else {
+            total_delta += or_opt_move(distances, candidates, state, a);
+        }
+    }
+    STATS_END_PHASE();
+    return total_delta;
+}
+
+// Same perturbation as two_opt_and_swap, but each trial is repaired with
+// Lin-Kernighan steps. The stronger local search makes full scans of all node
+// pairs unnecessary, so only candidate pairs are swapped.
+TourResult lin_kernighan(const Distances* distances, const CandidateList* candidates, RunArena* arena, const int* initial_tour, int n, int abandon_above, const Budget* budget) {
+    TourState* state = &arena->state;
+    reset_tour_state(state, initial_tour);
+    state->budget = budget;
+    for (int i = 0; i < n; i++) push_node(state, initial_tour[i]);
+    int shortest_dist = calculate_tour_length(initial_tour, n, distances);
+    shortest_dist += lk_local(distances, candidates, state);
+    state->log_size = 0;
+    bool improved = true;
+    int stride = perturbation_stride(n);
+    STATS_PHASE(PHASE_PERTURB);
+
+    while (improved) {
+        improved = false;
+        for (int i = 0, u = 0; i < n; i++, u = (int)(((long long)u + stride) % n)) {
+            if (budget_spent(budget, shortest_dist)) break;
+            for (int p = 0; p < candidates->k; p++) {
+                int v = candidates->nodes[u * candidates->k + p];
+                int delta = swap_delta(distances, &state->tour, u, v);
+                tour_swap(&state->tour, u, v);
+                STATS_ADD(moves_applied, 1);
+                push_node(state, u);
+                push_node(state, v);
+                push_node(state, tour_prev(&state->tour, u));
+                push_node(state, tour_next(&state->tour, u));
+                push_node(state, tour_prev(&state->tour, v));
+                push_node(state, tour_next(&state->tour, v));
+                delta += lk_local(distances, candidates, state);
+                if (delta <= 0) {
+                    shortest_dist += delta;
+                    state->log_size = 0;
+                    if (delta == 0) continue;
+                    improved = true;
+                    LOG(LOG_PROGRESS, "LK improvement: %d\n", shortest_dist);
+                } else {
+                    undo_moves(state, 0);
+                    tour_swap(&state->tour, u, v);
+                }
+            }
+        }
+        if (shortest_dist > abandon_above) break;
+    }
+    STATS_END_PHASE();
+
+    TourResult result = {arena->result, shortest_dist};
+    tour_to_array(&state->tour, result.tour);
+    return result;
+}
+
+// splitmix64: any seed, including 0, gives a full-period stream.
+uint64_t next_random(uint64_t* state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+int random_below(uint64_t* state, int bound) {
+    return (int)(((next_random(state) >> 32) * (uint64_t)bound) >> 32);
+}
+
+// Kicks the tour at a random node a, as logged 2-opt moves, queues the ends of
+// the changed edges and returns the change in length. Segments B and C of at
+// most max_segment nodes follow a, then comes d. The double bridge turns
+// a B C d into a C B d by reversing B, then C, then both; the segment
+// reversal turns a B c into a B' c. Both leave the rest of the tour as it is,
+// so only the kicked region needs to be re-optimized.
+int apply_kick(const Distances* distances, TourState* state, uint64_t* rng, int max_segment) {
+    const Tour* tour = &state->tour;
+    int a = random_below(rng, state->n);
+    int b1 = tour_next(tour, a), b2 = b1;
+    for (int i = random_below(rng, max_segment); i > 0; i--) b2 = tour_next(tour, b2);
+    int c1 = tour_next(tour, b2);
+    int delta;
+    if (ILS_KICK == 1) {
+        delta = get_distance(distances, a, b2) + get_distance(distances, b1, c1)
+              - get_distance(distances, a, b1) - get_distance(distances, b2, c1);
+        two_opt_move(state, a, b1, b2, c1);
+    } else {
+        int c2 = c1;
+        for (int i = random_below(rng, max_segment); i > 0; i--) c2 = tour_next(tour, c2);
+        int d = tour_next(tour, c2);
+        delta = get_distance(distances, a, c1) + get_distance(distances, c2, b1) + get_distance(distances, b2, d)
+              - get_distance(distances, a, b1) - get_distance(distances, b2, c1) - get_distance(distances, c2, d);
+        two_opt_move(state, a, b1, b2, c1); // a B' C d
+        two_opt_move(state, b1, c1, c2, d); // a B' C' d
+        two_opt_move(state, a, b2, c1, d); // a C B d
+        push_node(state, c2);
+        push_node(state, d);
+    }
+    push_node(state, a);
+    push_node(state, b1);
+    push_node(state, b2);
+    push_node(state, c1);
+    return delta;
+}
+
+// Iterated local search: each kick is repaired by the local search of the
+// chosen optimizer and undone unless ILS_ACCEPT keeps it. With restarts, the
+// current tour can get longer than the best one, which is then copied to the
+// result before each restart.
+TourResult iterated_local_search(const Distances* distances, const CandidateList* candidates, RunArena* arena, const int* initial_tour, int n, int abandon_above, const Budget* budget, uint64_t seed) {
+    int (*local_search)(const Distances*, const CandidateList*, TourState*) = USE_LIN_KERNIGHAN ? lk_local : or2opt_local;
+    TourState* state = &arena->state;
+    reset_tour_state(state, initial_tour);
+    state->budget = budget;
+    for (int i = 0; i < n; i++) push_node(state, initial_tour[i]);
+    int current_dist = calculate_tour_length(initial_tour, n, distances);
+    current_dist += local_search(distances, candidates, state);
+    state->log_size = 0;
+
+    uint64_t rng = seed;
+    int max_segment = ILS_SEGMENT < (n - 2) / 2 ? ILS_SEGMENT : (n - 2) / 2;
+    long long num_kicks = n < 8 ? 0 : ILS_KICKS > 0 ? ILS_KICKS : 10LL * n;
+    int stagnation = ILS_STAGNATION > 0 ? ILS_STAGNATION : n;
+    int best_dist = current_dist, stagnant = 0;
+    bool best_is_current = true;
+    STATS_PHASE(PHASE_PERTURB);
+
+    for (long long kick = 1; kick <= num_kicks; kick++) {
+        if (budget_spent(budget, best_dist)) break;
+        int delta = apply_kick(distances, state, &rng, max_segment);
+        delta += local_search(distances, candidates, state);
+        if (delta < 0 || (delta == 0 && ILS_ACCEPT != 0)) {
+            current_dist += delta;
+            state->log_size = 0;
+        } else {
+            undo_moves(state, 0);
+        }
+        stagnant = delta < 0 ? 0 : stagnant + 1;
+        if (current_dist < best_dist) {
+            best_dist = current_dist;
+            best_is_current = true;
+            LOG(LOG_PROGRESS, "ILS improvement: %d\n", best_dist);
+        }
+
+        if (ILS_ACCEPT == 2 && stagnant >= stagnation) {
+            // Restart from the current tour kicked at n / 50 + 1 random places at once.
+            if (best_is_current) tour_to_array(&state->tour, arena->result);
+            best_is_current = false;
+            for (int i = 0; i <= n / 50; i++) current_dist += apply_kick(distances, state, &rng, max_segment);
+            current_dist += local_search(distances, candidates, state);
+            state->log_size = 0;
+            stagnant = 0;
+            STATS_ADD(restarts, 1);
+        }
+        if (kick % n == 0 && best_dist > abandon_above) break;
+    }
+    STATS_END_PHASE();
+
+    if (best_is_current) tour_to_array(&state->tour, arena->result);
+    TourResult result = {arena->result, best_dist};
+    return result;
+}
+
+// The tour starts at origin and continues from initial_point. Without a
+// k-d tree, nodes missing from the candidate lists are found by a linear scan.
+// Returns the initial_tour buffer of the arena.
+int* nearest_neighbor(const KdTree* tree, const Distances* distances, const CandidateList* candidates, RunArena* arena, int n, int origin, int initial_point) {
+    int* tour = arena->initial_tour;
+    bool* visited = arena->visited;
+    int* remaining = arena->remaining;
+    memset(visited, 0, n * sizeof(bool));
+    int tour_size = 0;
+
+    if (tree) {
+        for (int i = 0; i < tree->num_nodes; i++) remaining[i] = tree->nodes[i].hi - tree->nodes[i].lo;
+    }
+
+    tour[tour_size++] = origin;
+    visited[origin] = true;
+    if (tree) kd_remove(tree, remaining, origin);
+    if (initial_point != origin && initial_point >= 0 && initial_point < n) {
+        tour[tour_size++] = initial_point;
+        visited[initial_point] = true;
+        if (tree) kd_remove(tree, remaining, initial_point);
+    }
+    int last_element = initial_point != origin ? initial_point : origin;
+
+    while (tour_size < n) {
+        int next_node = -1;
+        // Candidate lists and the tree order nodes the same way, so the first
+        // unvisited candidate is already the nearest unvisited node.
+        for (int k = 0; k < candidates->k; k++) {
+            int c = candidates->nodes[last_element * candidates->k + k];
+            if (!visited[c]) {
+                next_node = c;
+                break;
+            }
+        }
+        if (next_node == -1 && tree) {
+            Neighbor nearest;
+            int count = 0;
+            kd_search(tree, 0, remaining, visited, last_element, 1, &nearest, &count);
+            next_node = nearest.node;
+        } else if (next_node == -1) {
+            Neighbor nearest = {-1, INT_MAX};
+            for (int j = 0; j < n; j++) {
+                if (visited[j]) continue;
+                Neighbor candidate = {j, get_distance(distances, last_element, j)};
+                if (nearest.node < 0 || compare_neighbors(&candidate, &nearest) < 0) nearest = candidate;
+            }
+            next_node = nearest.node;
+        }
+        tour[tour_size++] = next_node;
+        visited[next_node] = true;
+        if (tree) kd_remove(tree, remaining, next_node);
+        last_element = next_node;
+    }
+
+    if (LOG_LEVEL >= LOG_DEBUG) {
+        printf("[");
+        for (int i = 0; i < n; i++) {
+            printf("%d", tour[i]);
+            if (i < n - 1) printf(", ");
+        }
+        printf("]\n");
+    }
+    return tour;
+}
+
+void free_distances(Distances* distances) {
+    free(distances->triangle);
+    distances->triangle = NULL;
+}
+
+void free_candidates(CandidateList* candidates) {
+    free(candidates->nodes);
+    free(candidates->distances);
+    candidates->nodes = NULL;
+    candidates->distances = NULL;
+}
+
+// Length of the nearest neighbor tour from node 0, read from the matrix.
+int nearest_neighbor_length(const Distances* distances) {
+    int n = distances->n;
+    bool* visited = calloc(n, sizeof(bool));
+    int* row = malloc(n * sizeof(int));
+    int length = 0, last = 0;
+    visited[0] = true;
+    for (int step = 1; step < n; step++) {
+        int next = -1, next_dist = INT_MAX;
+        distance_row(distances, last, row);
+        for (int j = 0; j < n; j++) {
+            if (!visited[j] && row[j] < next_dist) {
+                next = j;
+                next_dist = row[j];
+            }
+        }
+        visited[next] = true;
+        length += next_dist;
+        last = next;
+    }
+    free(visited);
+    free(row);
+    return length + get_distance(distances, last, 0);
+}
+
+// The candidate graph is stored once with every edge in both directions.
+void init_one_tree(OneTree* tree, const CandidateList* candidates, int n) {
+    int k = candidates->k;
+    tree->n = n;
+    tree->pi = calloc(n, sizeof(double));
+    tree->best_pi = calloc(n, sizeof(double));
+    tree->key = malloc(n * sizeof(double));
+    tree->parent = malloc(n * sizeof(int));
+    tree->order = malloc(n * sizeof(int));
+    tree->degree = malloc(n * sizeof(int));
+    tree->in_tree = malloc(n * sizeof(bool));
+    tree->row = malloc(n * sizeof(int));
+    tree->first_edge = calloc(n + 1, sizeof(int));
+    tree->edge_node = malloc(2 * (size_t)n * k * sizeof(int));
+    tree->edge_distance = malloc(2 * (size_t)n * k * sizeof(int));
+    tree->heap = malloc((2 * (size_t)n * k + 1) * sizeof(HeapEntry));
+
+    for (size_t e = 0; e < (size_t)n * k; e++) {
+        tree->first_edge[e / k + 1]++;
+        tree->first_edge[candidates->nodes[e] + 1]++;
+    }
+    for (int i = 0; i < n; i++) tree->first_edge[i + 1] += tree->first_edge[i];
+    for (size_t e = 0; e < (size_t)n * k; e++) {
+        int a = (int)(e / k), b = candidates->nodes[e], d = candidates->distances[e];
+        tree->edge_node[tree->first_edge[a]] = b;
+        tree->edge_distance[tree->first_edge[a]++] = d;
+        tree->edge_node[tree->first_edge[b]] = a;
+        tree->edge_distance[tree->first_edge[b]++] = d;
+    }
+    for (int i = n; i > 0; i--) tree->first_edge[i] = tree->first_edge[i - 1];
+    tree->first_edge[0] = 0;
+}
+
+void free_one_tree(OneTree* tree) {
+    free(tree->pi);
+    free(tree->best_pi);
+    free(tree->key);
+    free(tree->parent);
+    free(tree->order);
+    free(tree->degree);
+    free(tree->in_tree);
+    free(tree->row);
+    free(tree->first_edge);
+    free(tree->edge_node);
+    free(tree->edge_distance);
+    free(tree->heap);
+}
+
+void heap_push(HeapEntry* heap, int* size, HeapEntry entry) {
+    int i = (*size)++;
+    while (i > 0 && heap[(i - 1) / 2].key > entry.key) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = entry;
+}
+
+HeapEntry heap_pop(HeapEntry* heap, int* size) {
+    HeapEntry top = heap[0], last = heap[--*size];
+    int i = 0;
+    for (int child = 1; child < *size; child = 2 * i + 1) {
+        if (child + 1 < *size && heap[child + 1].key < heap[child].key) child++;
+        if (heap[child].key >= last.key) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+// Builds the minimum 1-tree under tree->pi and returns its length minus
+// 2 * sum(pi), a lower bound on every tour. O(n^2).
+double one_tree(const Distances* distances, OneTree* tree) {
+    int n = tree->n;
+    const double* pi = tree->pi;
+    double length = 0;
+    for (int i = 0; i < n; i++) {
+        tree->key[i] = INFINITY;
+        tree->parent[i] = -1;
+        tree->degree[i] = 0;
+        tree->in_tree[i] = false;
+        length -= 2 * pi[i];
+    }
+
+    int next = 1;
+    tree->key[1] = 0;
+    for (int added = 0; added < n - 1; added++) {
+        int u = next;
+        tree->in_tree[u] = true;
+        tree->order[added] = u;
+        if (tree->parent[u] >= 0) {
+            length += tree->key[u];
+            tree->degree[u]++;
+            tree->degree[tree->parent[u]]++;
+        }
+        next = -1;
+        distance_row(distances, u, tree->row);
+        for (int v = 1; v < n; v++) {
+            if (tree->in_tree[v]) continue;
+            double cost = tree->row[v] + pi[u] + pi[v];
+            if (cost < tree->key[v]) {
+                tree->key[v] = cost;
+                tree->parent[v] = u;
+            }
+            if (next < 0 || tree->key[v] < tree->key[next]) next = v;
+        }
+    }
+
+    double first_cost = INFINITY, second_cost = INFINITY;
+    tree->first = tree->second = -1;
+    distance_row(distances, 0, tree->row);
+    for (int v = 1; v < n; v++) {
+        double cost = tree->row[v] + pi[0] + pi[v];
+        if (cost < first_cost) {
+            tree->second = tree->first;
+            second_cost = first_cost;
+            tree->first = v;
+            first_cost = cost;
+        } else if (cost < second_cost) {
+            tree->second = v;
+            second_cost = cost;
+        }
+    }
+    tree->key[0] = second_cost;
+    tree->degree[0] = 2;
+    tree->degree[tree->first]++;
+    tree->degree[tree->second]++;
+    return length + first_cost + second_cost;
+}
+
+// Same 1-tree restricted to the candidate graph, with a heap: O(nk log n).
+// Not a bound by itself, since the minimum 1-tree may use other edges.
+// Returns NAN when the candidate graph is not connected.
+double sparse_one_tree(OneTree* tree) {
+    int n = tree->n;
+    const double* pi = tree->pi;
+    double length = 0;
+    for (int i = 0; i < n; i++) {
+        tree->key[i] = INFINITY;
+        tree->parent[i] = -1;
+        tree->degree[i] = 0;
+        tree->in_tree[i] = false;
+        length -= 2 * pi[i];
+    }
+
+    int heap_size = 0, added = 0;
+    tree->key[1] = 0;
+    heap_push(tree->heap, &heap_size, (HeapEntry){0, 1});
+    while (heap_size > 0) {
+        int u = heap_pop(tree->heap, &heap_size).node;
+        if (tree->in_tree[u]) continue;
+        tree->in_tree[u] = true;
+        tree->order[added++] = u;
+        if (tree->parent[u] >= 0) {
+            length += tree->key[u];
+            tree->degree[u]++;
+            tree->degree[tree->parent[u]]++;
+        }
+        for (int e = tree->first_edge[u]; e < tree->first_edge[u + 1]; e++) {
+            int v = tree->edge_node[e];
+            if (v == 0 || tree->in_tree[v]) continue;
+            double cost = tree->edge_distance[e] + pi[u] + pi[v];
+            if (cost < tree->key[v]) {
+                tree->key[v] = cost;
+                tree->parent[v] = u;
+                heap_push(tree->heap, &heap_size, (HeapEntry){cost, v});
+            }
+        }
+    }
+    if (added < n - 1) return NAN;
+
+    double first_cost = INFINITY, second_cost = INFINITY;
+    tree->first = tree->second = -1;
+    for (int e = tree->first_edge[0]; e < tree->first_edge[1]; e++) {
+        int v = tree->edge_node[e];
+        double cost = tree->edge_distance[e] + pi[0] + pi[v];
+        if (v == tree->first || v == tree->second) continue;
+        if (cost < first_cost) {
+            tree->second = tree->first;
+            second_cost = first_cost;
+            tree->first = v;
+            first_cost = cost;
+        } else if (cost < second_cost) {
+            tree->second = v;
+            second_cost = cost;
+        }
+    }
+    if (tree->second < 0) return NAN;
+    tree->key[0] = second_cost;
+    tree->degree[0] = 2;
+    tree->degree[tree->first]++;
+    tree->degree[tree->second]++;
+    return length + first_cost + second_cost;
+}
+
+// Subgradient ascent on the penalties (Held and Karp): nodes of degree above
+// 2 in the 1-tree get dearer, leaves cheaper, with the step of Held, Wolfe
+// and Crowder towards upper_bound. The step is halved whenever the bound
+// stalls for period steps. Starts from tree->pi, leaves the best penalties
+// in tree->best_pi and returns their 1-tree length.
+double ascend(const Distances* distances, OneTree* tree, bool sparse, int upper_bound, int max_steps, double lambda, int period) {
+    int n = tree->n;
+    double best = -INFINITY;
+    int stalled = 0;
+    for (int step = 0; step < max_steps && lambda > 1e-4; step++) {
+        double length = sparse ? sparse_one_tree(tree) : one_tree(distances, tree);
+        if (length > best + 1e-9) {
+            best = length;
+            memcpy(tree->best_pi, tree->pi, n * sizeof(double));
+            stalled = 0;
+        } else if (++stalled >= period) {
+            lambda /= 2;
+            stalled = 0;
+        }
+        long long norm = 0;
+        for (int i = 0; i < n; i++) norm += (long long)(tree->degree[i] - 2) * (tree->degree[i] - 2);
+        if (norm == 0 || best > upper_bound - 1) break; // the 1-tree is a tour, or no tour is shorter than upper_bound
+        double size = lambda * (upper_bound - length) / norm;
+        for (int i = 0; i < n; i++) tree->pi[i] += size * (tree->degree[i] - 2);
+    }
+    memcpy(tree->pi, tree->best_pi, n * sizeof(double));
+    return best;
+}
+
+// Held-Karp bound. When the candidate graph is connected, the ascent runs on
+// it and then takes a few steps on the complete graph, whose 1-tree may use
+// edges the candidates lack. Leaves the best penalties and their full 1-tree
+// in tree and returns the bound, rounded up as tour lengths are integers.
+int held_karp_bound(const Distances* distances, OneTree* tree, int upper_bound) {
+    int n = tree->n;
+    bool sparse = !isnan(sparse_one_tree(tree));
+    long long dense_steps = 100000000LL / ((long long)n * n);
+    int max_steps = BOUND_ITERATIONS > 0 ? BOUND_ITERATIONS : sparse ? 1000 : dense_steps < 100 ? 100 : dense_steps > 1000 ? 1000 : (int)dense_steps;
+    int period = max_steps / 20 > 5 ? max_steps / 20 : 5;
+
+    double best = ascend(distances, tree, sparse, upper_bound, max_steps, 0.5, period);
+    if (sparse) best = ascend(distances, tree, false, upper_bound, 30, 0.1, 5);
+    one_tree(distances, tree);
+    LOG(LOG_DEBUG, "Held-Karp ascent on the %s graph\n", sparse ? "candidate" : "complete");
+    return (int)ceil(best - 1e-6);
+}
+
+// alpha(a, b) is how much longer the shortest 1-tree that contains (a, b) is
+// than the minimum one (Helsgaun): 0 on tree edges, otherwise the cost of
+// (a, b) minus the longest edge on the tree path between a and b, which it
+// would replace. For each a, beta[b] holds that longest edge; walking the
+// nodes in Prim order reaches every parent before its children. O(n^2).
+void alpha_candidates(const Distances* distances, const OneTree* tree, CandidateList* candidates) {
+    int n = tree->n;
+    int k = n - 1 < NUM_CANDIDATES ? n - 1 : NUM_CANDIDATES;
+    const double* pi = tree->pi;
+    candidates->k = k;
+    candidates->nodes = malloc((size_t)n * k * sizeof(int));
+    candidates->distances = malloc((size_t)n * k * sizeof(int));
+    double* beta = malloc(n * sizeof(double));
+    int* mark = malloc(n * sizeof(int));
+    double* best_alpha = malloc(k * sizeof(double));
+    int* row = malloc(n * sizeof(int));
+    int* best = candidates->nodes;
+    for (int i = 0; i < n; i++) mark[i] = -1;
+
+    for (int a = 0; a < n; a++, best += k) {
+        if (a != 0) {
+            beta[a] = -INFINITY;
+            mark[a] = a;
+            for (int b = a; tree->parent[b] >= 0; b = tree->parent[b]) {
+                beta[tree->parent[b]] = fmax(beta[b], tree->key[b]);
+                mark[tree->parent[b]] = a;
+            }
+            for (int i = 0; i < n - 1; i++) {
+                int b = tree->order[i];
+                if (mark[b] != a) beta[b] = fmax(beta[tree->parent[b]], tree->key[b]);
+            }
+        }
+        int count = 0;
+        distance_row(distances, a, row);
+        for (int b = 0; b < n; b++) {
+            if (b == a) continue;
+            double cost = row[b] + pi[a] + pi[b];
+            double alpha;
+            if (a == 0 || b == 0) {
+                int other = a == 0 ? b : a;
+                alpha = other == tree->first || other == tree->second ? 0 : cost - tree->key[0];
+            } else {
+                alpha = cost - beta[b];
+            }
+            if (count == k && alpha >= best_alpha[k - 1]) continue;
+            int slot = count < k ? count++ : k - 1;
+            while (slot > 0 && best_alpha[slot - 1] > alpha) {
+                best_alpha[slot] = best_alpha[slot - 1];
+                best[slot] = best[slot - 1];
+                slot--;
+            }
+            best_alpha[slot] = alpha;
+            best[slot] = b;
+        }
+        for (int j = 0; j < k; j++) candidates->distances[(size_t)a * k + j] = row[best[j]];
+    }
+    free(row);
+    free(beta);
+    free(mark);
+    free(best_alpha);
+}
+
+void init_tour_merge(TourMerge* merge, int n) {
+    merge->n = n;
+    merge->pos_child = malloc(n * sizeof(int));
+    merge->pos_b = malloc(n * sizeof(int));
+    merge->component = malloc(n * sizeof(int));
+    merge->mate_b = malloc(n * sizeof(int));
+    merge->length_a = malloc(n * sizeof(int));
+    merge->length_b = malloc(n * sizeof(int));
+    merge->first_portal = malloc((n + 1) * sizeof(int));
+    merge->portals = malloc(n * sizeof(int));
+    merge->by_position = malloc(n * sizeof(Neighbor));
+    merge->slot_node = malloc(2 * n * sizeof(int));
+    merge->slot_of = malloc(n * sizeof(int));
+    merge->fuse = malloc(n * sizeof(bool));
+    merge->child = malloc(n * sizeof(int));
+    merge->next_child = malloc(n * sizeof(int));
+}
+
+void free_tour_merge(TourMerge* merge) {
+    free(merge->pos_child);
+    free(merge->pos_b);
+    free(merge->component);
+    free(merge->mate_b);
+    free(merge->length_a);
+    free(merge->length_b);
+    free(merge->first_portal);
+    free(merge->portals);
+    free(merge->by_position);
+    free(merge->slot_node);
+    free(merge->slot_of);
+    free(merge->fuse);
+    free(merge->child);
+    free(merge->next_child);
+}
+
+int find_component(int* component, int node) {
+    while (component[node] != node) {
+        component[node] = component[component[node]];
+        node = component[node];
+    }
+    return node;
+}
+
+bool tour_adjacent(const int* tour, const int* pos, int n, int u, int v) {
+    int p = pos[u];
+    return tour[(p + 1) % n] == v || tour[(p + n - 1) % n] == v;
+}
+
+// Position of the tour where a run of nodes of one component starts, 0 when
+// the whole tour is a single component.
+int run_start(const int* tour, int n, const int* component) {
+    for (int i = 0; i < n; i++) {
+        if (component[tour[i]] != component[tour[(i + n - 1) % n]]) return i;
+    }
+    return 0;
+}
+
+// Pairs the two ends of each run of the tour through a component.
+void mark_paths(const int* tour, int n, const int* component, int* mate) {
+    int start = run_start(tour, n, component);
+    for (int k = 0; k < n;) {
+        int first = tour[(start + k) % n], length = 1;
+        while (k + length < n && component[tour[(start + k + length) % n]] == component[first]) length++;
+        int last = tour[(start + k + length - 1) % n];
+        mate[first] = last;
+        mate[last] = first;
+        k += length;
+    }
+}
+
+// Slot reached by leaving slot through the child's path outside the
+// component: the last node of run r leads to the first of run r + 1.
+int outside_slot(int slot, int num_slots) {
+    return slot % 2 ? (slot + 1) % num_slots : (slot + num_slots - 1) % num_slots;
+}
+
+// Replaces the child's paths through component c by those of tour_b if the
+// result is still one cycle, and tells whether it did. The child's runs
+// through c, in tour order, are joined by its outside paths; following
+// tour_b's inside paths and the child's outside paths from the first run
+// must pass through every run before coming back.
+bool swap_component(TourMerge* merge, const int* tour_b, int c) {
+    int n = merge->n;
+    const int* component = merge->component;
+    const int* child = merge->child;
+    int num_portals = merge->first_portal[c + 1] - merge->first_portal[c];
+    if (num_portals == 0) return false;
+    for (int i = 0; i < num_portals; i++) {
+        int node = merge->portals[merge->first_portal[c] + i];
+        merge->by_position[i] = (Neighbor){node, merge->pos_child[node]};
+    }
+    qsort(merge->by_position, num_portals, sizeof(Neighbor), compare_neighbors);
+
+    // Runs may wrap around the end of the array, so start at a first node.
+    int first = 0;
+    while (component[child[(merge->by_position[first].distance + n - 1) % n]] == c) first++;
+    int num_slots = 0;
+    for (int i = 0; i < num_portals; i++) {
+        int node = merge->by_position[(first + i) % num_portals].node, p = merge->pos_child[node];
+        if (component[child[(p + n - 1) % n]] != c) merge->slot_node[num_slots++] = node;
+        if (component[child[(p + 1) % n]] != c) merge->slot_node[num_slots++] = node;
+        merge->slot_of[node] = num_slots - 1;
+    }
+
+    // A single-node run is its own inside path, and is left by its other slot.
+    int num_runs = num_slots / 2, slot = 0, visited = 0;
+    do {
+        int x = merge->slot_node[slot], y = merge->mate_b[x];
+        slot = outside_slot(y == x ? slot ^ 1 : merge->slot_of[y], num_slots);
+        visited++;
+    } while (slot != 0 && visited <= num_runs);
+    if (visited != num_runs) return false;
+
+    int size = 0;
+    for (int r = 0; r < num_runs; r++) {
+        int x = merge->slot_node[slot], y = merge->mate_b[x], p = merge->pos_b[x];
+        int step = x == y || component[tour_b[(p + 1) % n]] == c ? 1 : n - 1;
+        for (merge->next_child[size++] = x; tour_b[p] != y; merge->next_child[size++] = tour_b[p]) p = (p + step) % n;
+        slot = y == x ? slot ^ 1 : merge->slot_of[y];
+        int next = outside_slot(slot, num_slots), q = merge->pos_child[y];
+        step = slot % 2 ? 1 : n - 1;
+        for (q = (q + step) % n; child[q] != merge->slot_node[next]; q = (q + step) % n) merge->next_child[size++] = child[q];
+        slot = next;
+    }
+    int* previous = merge->child;
+    merge->child = merge->next_child;
+    merge->next_child = previous;
+    for (int i = 0; i < n; i++) merge->pos_child[merge->child[i]] = i;
+    return true;
+}
+
+// One pass of partition crossover between merge->child and tour_b. Removing
+// the edges both tours share splits the union of their edges into
+// components, which the tours can only enter and leave through shared edges.
+// Shared edges touching a node marked in merge->fuse are kept instead, which
+// fuses the components the previous pass could not swap with their
+// neighbors. In a component where tour_b is shorter, its paths replace those
+// of the child whenever the result is still one cycle; the nodes of the
+// others are marked for the next pass. Returns how much shorter the child got
+// and sets *failed when some component was not swapped. O(n) plus O(n) per
+// replaced component.
+int crossover_pass(const Distances* distances, TourMerge* merge, const int* tour_b, bool* failed) {
+    int n = merge->n;
+    int* component = merge->component;
+    const int* tour_a = merge->child;
+    for (int i = 0; i < n; i++) {
+        merge->pos_child[tour_a[i]] = i;
+        merge->pos_b[tour_b[i]] = i;
+        component[i] = i;
+        merge->mate_b[i] = -1;
+        merge->length_a[i] = merge->length_b[i] = 0;
+        merge->first_portal[i + 1] = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        int u = tour_a[i], v = tour_a[(i + 1) % n];
+        if (!tour_adjacent(tour_b, merge->pos_b, n, u, v) || merge->fuse[u] || merge->fuse[v]) component[find_component(component, u)] = find_component(component, v);
+        u = tour_b[i], v = tour_b[(i + 1) % n];
+        if (!tour_adjacent(tour_a, merge->pos_child, n, u, v)) component[find_component(component, u)] = find_component(component, v);
+    }
+    for (int i = 0; i < n; i++) component[i] = find_component(component, i);
+
+    mark_paths(tour_b, n, component, merge->mate_b);
+    for (int i = 0; i < n; i++) {
+        int a = tour_a[i], next_a = tour_a[(i + 1) % n], b = tour_b[i], next_b = tour_b[(i + 1) % n];
+        if (component[a] == component[next_a]) merge->length_a[component[a]] += get_distance(distances, a, next_a);
+        if (component[b] == component[next_b]) merge->length_b[component[b]] += get_distance(distances, b, next_b);
+        if (merge->mate_b[i] >= 0) merge->first_portal[component[i] + 1]++;
+    }
+    merge->first_portal[0] = 0;
+    for (int c = 0; c < n; c++) merge->first_portal[c + 1] += merge->first_portal[c];
+    for (int i = 0; i < n; i++) {
+        if (merge->mate_b[i] >= 0) merge->portals[merge->first_portal[component[i]]++] = i;
+    }
+    for (int c = n; c > 0; c--) merge->first_portal[c] = merge->first_portal[c - 1];
+    merge->first_portal[0] = 0;
+
+    int gain = 0;
+    *failed = false;
+    for (int c = 0; c < n; c++) {
+        if (merge->length_b[c] >= merge->length_a[c]) {
+            merge->length_a[c] = 0;
+        } else if (swap_component(merge, tour_b, c)) {
+            gain += merge->length_a[c] - merge->length_b[c];
+            merge->length_a[c] = 0;
+        } else {
+            *failed = true;
+        }
+    }
+    // Components still holding a length are the ones that failed.
+    for (int i = 0; i < n; i++) merge->fuse[i] = merge->length_a[component[i]] > 0;
+    return gain;
+}
+
+// Partition crossover of tour_a and tour_b, retried MERGE_FUSIONS times on
+// fused components. Writes the child into merge->child and returns how much
+// shorter than tour_a it is.
+int partition_crossover(const Distances* distances, TourMerge* merge, const int* tour_a, const int* tour_b) {
+    memcpy(merge->child, tour_a, merge->n * sizeof(int));
+    memset(merge->fuse, 0, merge->n * sizeof(bool));
+    int gain = 0;
+    bool failed = true;
+    for (int pass = 0; pass <= MERGE_FUSIONS && failed; pass++) gain += crossover_pass(distances, merge, tour_b, &failed);
+    return gain;
+}
+
+// Replaces the best tour by its partition crossover with tour when that is
+// shorter. The child buffer and the old best tour trade places.
+void merge_into_best(MultiStart* ms, const int* tour) {
+    STATS_PHASE(PHASE_MERGE);
+    int gain = partition_crossover(ms->distances, &ms->merge, ms->best_tour, tour);
+    STATS_END_PHASE();
+    if (gain <= 0) return;
+    int* previous = ms->best_tour;
+    ms->best_tour = ms->merge.child;
+    ms->merge.child = previous;
+    ms->shortest_dist -= gain;
+    atomic_store(&ms->incumbent, ms->shortest_dist);
+    LOG(LOG_PROGRESS, "Tour merging: %d\n", ms->shortest_dist);
+}
+
+// Runs on the last thread to reach the batch barrier, while the others wait.
+void collect_batch(MultiStart* ms) {
+    for (int t = 0; t < ms->num_threads; t++) {
+        TourResult result = ms->batch[t];
+        if (!result.tour) continue;
+        if (result.dist < ms->shortest_dist) {
+            bool had_best = ms->shortest_dist < INT_MAX;
+            ms->arenas[t].result = ms->best_tour;
+            ms->best_tour = result.tour;
+            ms->shortest_dist = result.dist;
+            LOG(LOG_PROGRESS, "New shortest dist: %d\n", ms->shortest_dist);
+            // The previous best tour is a local optimum too.
+            if (USE_TOUR_MERGING && had_best) merge_into_best(ms, ms->arenas[t].result);
+        } else if (USE_TOUR_MERGING) {
+            merge_into_best(ms, result.tour);
+        }
+        ms->batch[t].tour = NULL;
+    }
+
+    if (ms->lower_bound > 0) LOG(LOG_PROGRESS, "Gap to lower bound: %.3f%%\n", 100.0 * (ms->shortest_dist - ms->lower_bound) / ms->lower_bound);
+
+    ms->next_run += ms->num_threads;
+    if (ms->shortest_dist < ms->saved_dist) {
+        submit_tour(&ms->writer, ms->best_tour, ms->shortest_dist, ms->next_run, wall_time() - ms->start);
+        ms->saved_dist = ms->shortest_dist;
+    } else if (CHECKPOINTS && ms->saved_dist < INT_MAX) {
+        submit_tour(&ms->writer, NULL, 0, ms->next_run, wall_time() - ms->start);
+    }
+
+    long long cutoff = (long long)ms->shortest_dist * (100 + ABANDON_PERCENT) / 100;
+    ms->abandon_above = cutoff < INT_MAX ? (int)cutoff : INT_MAX;
+    if (!ms->stop && budget_spent(&ms->budget, ms->shortest_dist)) {
+        LOG(LOG_SUMMARY, "Stopping early: %s\n", wall_time() >= ms->budget.deadline && ms->budget.deadline > 0 ? "time limit reached" : "target reached");
+        ms->stop = true;
+    }
+}
+
+void* multi_start_worker(void* arg) {
+    Worker* worker = arg;
+    MultiStart* ms = worker->shared;
+    RunArena* arena = &ms->arenas[worker->id];
+    STATS_START_THREAD("run", PHASE_OTHER);
+    init_run_arena(arena, ms->num_points, ms->tree);
+
+    for (int first_run = 0; first_run < ms->num_runs; first_run += ms->num_threads) {
+        int run = first_run + worker->id;
+        if (run < ms->num_runs && !ms->stop) {
+            int initial_point = ms->first_point + run;
+            LOG(LOG_PROGRESS, "current run: [%d], time: %.2f seconds\n", initial_point, wall_time() - ms->start);
+
+            int origin = ms->renumbered ? ms->renumbered[0] : 0;
+            int start = ms->renumbered && initial_point < ms->num_points ? ms->renumbered[initial_point] : initial_point;
+            bool warm = ms->start_tour && initial_point == 1; // only the first run of the whole solve, not of a resumed one
+            STATS_ADD(restarts, 1);
+            STATS_PHASE(PHASE_CONSTRUCT);
+            const int* initial_tour = warm ? ms->start_tour : nearest_neighbor(ms->tree, ms->distances, ms->candidates, arena, ms->num_points, origin, start);
+            STATS_END_PHASE();
+            uint64_t seed = (uint64_t)SEED << 32 | (uint32_t)initial_point;
+            TourResult result = USE_ILS
+                ? iterated_local_search(ms->distances, ms->search_candidates, arena, initial_tour, ms->num_points, ms->abandon_above, &ms->budget, seed)
+                : USE_LIN_KERNIGHAN
+                ? lin_kernighan(ms->distances, ms->search_candidates, arena, initial_tour, ms->num_points, ms->abandon_above, &ms->budget)
+                : two_opt_and_swap(ms->distances, ms->search_candidates, arena, initial_tour, ms->num_points, ms->abandon_above, &ms->budget, warm);
+            ms->batch[worker->id] = result;
+
+            int incumbent = atomic_load(&ms->incumbent);
+            while (result.dist < incumbent && !atomic_compare_exchange_weak(&ms->incumbent, &incumbent, result.dist));
+            LOG(LOG_PROGRESS, "run [%d] finished: %d, best so far: %d\n", initial_point, result.dist, atomic_load(&ms->incumbent));
+        }
+
+        if (pthread_barrier_wait(&ms->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) collect_batch(ms);
+        pthread_barrier_wait(&ms->barrier);
+    }
+    free_run_arena(arena);
+    STATS_FINISH_THREAD();
+    return NULL;
+}
+
+int cell_start(const Partition* partition, int c) {
+    return (int)((long long)c * partition->instance->n / partition->num_cells);
+}
+
+// Solves one cell with a single run of the configured optimizer and writes
+// its tour in cell numbering. The candidate lists of the run are handed over
+// in candidates, with k = 0 for cells too small to search.
+void solve_cell(const Instance* cell, const Budget* budget, uint64_t seed, int* tour, CandidateList* candidates) {
+    int n = cell->n;
+    if (n < 8) {
+        for (int i = 0; i < n; i++) tour[i] = i;
+        *candidates = (CandidateList){NULL, NULL, 0};
+        return;
+    }
+    STATS_ADD(restarts, 1);
+    STATS_PHASE(PHASE_PREPROCESS);
+    KdTree tree;
+    if (cell->planar) build_kd_tree(&tree, cell);
+    const KdTree* cell_tree = cell->planar ? &tree : NULL;
+    Distances distances = pre_process(cell, cell_tree, candidates, 1);
+    RunArena arena;
+    init_run_arena(&arena, n, cell_tree);
+
+    STATS_SWITCH_PHASE(PHASE_CONSTRUCT);
+    int* initial_tour = nearest_neighbor(cell_tree, &distances, candidates, &arena, n, 0, 0);
+    STATS_END_PHASE();
+    TourResult result = USE_ILS
+        ? iterated_local_search(&distances, candidates, &arena, initial_tour, n, INT_MAX, budget, seed)
+        : USE_LIN_KERNIGHAN
+        ? lin_kernighan(&distances, candidates, &arena, initial_tour, n, INT_MAX, budget)
+        : two_opt_and_swap(&distances, candidates, &arena, initial_tour, n, INT_MAX, budget, false);
+    memcpy(tour, result.tour, n * sizeof(int));
+
+    free_run_arena(&arena);
+    free_distances(&distances);
+    if (cell->planar) free_kd_tree(&tree);
+}
+
+void* partition_worker(void* arg) {
+    Partition* partition = arg;
+    STATS_START_THREAD("cell", PHASE_OTHER);
+    const Instance* instance = partition->instance;
+    int max_size = instance->n / partition->num_cells + 1;
+    Instance cell = *instance;
+    cell.points = malloc(max_size * sizeof(Point));
+    int* nodes = malloc(max_size * sizeof(int));
+
+    for (int c = atomic_fetch_add(&partition->next_cell, 1); c < partition->num_cells; c = atomic_fetch_add(&partition->next_cell, 1)) {
+        int lo = cell_start(partition, c);
+        cell.n = cell_start(partition, c + 1) - lo;
+        for (int i = 0; i < cell.n; i++) {
+            nodes[i] = partition->order ? partition->order[lo + i] : lo + i;
+            cell.points[i] = instance->points[nodes[i]];
+        }
+        Budget budget = {.deadline = partition->deadline};
+        int cells_left = partition->num_cells - c;
+        if (budget.deadline > 0 && cells_left > partition->num_threads) {
+            double now = wall_time();
+            budget.deadline = now + (budget.deadline - now) * partition->num_threads / cells_left;
+        }
+        int* tour = partition->tour + lo;
+        CandidateList candidates;
+        solve_cell(&cell, &budget, (uint64_t)SEED << 32 | (uint32_t)c, tour, &candidates);
+        for (int i = 0; i < cell.n; i++) tour[i] = nodes[tour[i]];
+
+        int k = partition->candidates.k;
+        Point box_lo = cell.points[0], box_hi = cell.points[0];
+        for (int i = 0; i < cell.n; i++) {
+            box_lo.x = fmin(box_lo.x, cell.points[i].x);
+            box_lo.y = fmin(box_lo.y, cell.points[i].y);
+            box_hi.x = fmax(box_hi.x, cell.points[i].x);
+            box_hi.y = fmax(box_hi.y, cell.points[i].y);
+            size_t row = (size_t)nodes[i] * k;
+            for (int p = 0; p < k; p++) {
+                bool listed = p < candidates.k;
+                partition->candidates.nodes[row + p] = listed ? nodes[candidates.nodes[(size_t)i * candidates.k + p]] : -1;
+                partition->candidates.distances[row + p] = listed ? candidates.distances[(size_t)i * candidates.k + p] : 0;
+            }
+        }
+        partition->box_lo[c] = box_lo;
+        partition->box_hi[c] = box_hi;
+        free_candidates(&candidates);
+        LOG(LOG_PROGRESS, "cell [%d] solved: %d nodes\n", c, cell.n);
+    }
+    free(cell.points);
+    free(nodes);
+    STATS_FINISH_THREAD();
+    return NULL;
+}
+
+// Opens each cell tour into a path, in place. A cell is cut next to the node
+// where joining it to the end of the previous path costs least, counting the
+// removed edge, and walked from that node. The first cell loses its longest
+// edge.
+void stitch_cells(const Distances* distances, const Partition* partition) {
+    int* tour = partition->tour;
+    int* path = malloc((partition->instance->n / partition->num_cells + 1) * sizeof(int));
+    for (int c = 0; c < partition->num_cells; c++) {
+        int lo = cell_start(partition, c), size = cell_start(partition, c + 1) - lo;
+        int* cell = tour + lo;
+        int entry = 0, best_cost = INT_MAX;
+        bool backwards = false;
+        for (int i = 0; i < size; i++) {
+            int join = c > 0 ? get_distance(distances, tour[lo - 1], cell[i]) : 0;
+            int forwards_cost = join - get_distance(distances, cell[(i + size - 1) % size], cell[i]);
+            int backwards_cost = join - get_distance(distances, cell[i], cell[(i + 1) % size]);
+            if (forwards_cost < best_cost) {
+                best_cost = forwards_cost;
+                entry = i;
+                backwards = false;
+            }
+            if (backwards_cost < best_cost) {
+                best_cost = backwards_cost;
+                entry = i;
+                backwards = true;
+            }
+        }
+        for (int k = 0; k < size; k++) path[k] = cell[backwards ? (entry - k + size) % size : (entry + k) % size];
+        memcpy(cell, path, size * sizeof(int));
+    }
+    free(path);
+}
+
+// True when another cell may hold a point within reach of node, judged by
+// the bounding boxes: planar metrics never decrease with distance, so no
+// point of a box is nearer than the point of the box nearest to node.
+bool near_other_cell(const Partition* partition, const int* cell_of, int node, int reach) {
+    Point p = partition->instance->points[node];
+    for (int c = 0; c < partition->num_cells; c++) {
+        if (c == cell_of[node]) continue;
+        Point nearest = {fmin(fmax(p.x, partition->box_lo[c].x), partition->box_hi[c].x),
+                         fmin(fmax(p.y, partition->box_lo[c].y), partition->box_hi[c].y)};
+        if (partition->instance->distance(p, nearest) <= reach) return true;
+    }
+    return false;
+}
+
+// Solves the cells on num_threads workers, stitches them and refines the
+// result along the cell borders: only nodes with a candidate in another cell
+// start with their don't-look bit off. A node whose list within its cell
+// reaches no other cell already has its nearest nodes, so the k-d tree is
+// only queried for the others. Each cell gets an even share of 95% of the
+// time left before the deadline, and the refinement stops at it. Distances
+// are computed from coordinates. Returns a tour of its own.
+TourResult partition_tsp(const Prepared* prep, int num_threads, const Budget* budget) {
+    double start = wall_time();
+    const Instance* instance = &prep->work;
+    int n = instance->n;
+    int k = n - 1 < NUM_CANDIDATES ? n - 1 : NUM_CANDIDATES;
+    int cell_nodes = PARTITION_CELL_NODES > 0 ? PARTITION_CELL_NODES : n;
+    Partition partition = {
+        .instance = instance,
+        .order = prep->original_id ? NULL : hilbert_order(instance->points, n),
+        .tour = malloc(n * sizeof(int)),
+        .candidates = {malloc((size_t)n * k * sizeof(int)), malloc((size_t)n * k * sizeof(int)), k},
+        .box_lo = malloc((n + cell_nodes - 1) / cell_nodes * sizeof(Point)),
+        .box_hi = malloc((n + cell_nodes - 1) / cell_nodes * sizeof(Point)),
+        .num_cells = (n + cell_nodes - 1) / cell_nodes,
+        .num_threads = num_threads < (n + cell_nodes - 1) / cell_nodes ? num_threads : (n + cell_nodes - 1) / cell_nodes,
+        .deadline = budget->deadline > 0 ? start + (budget->deadline - start) * 0.95 : 0, // the rest is for the border refinement
+    };
+    atomic_init(&partition.next_cell, 0);
+    num_threads = partition.num_threads;
+    LOG(LOG_SUMMARY, "Cells: %d, threads: %d\n", partition.num_cells, num_threads);
+
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    for (int t = 0; t < num_threads; t++) pthread_create(&threads[t], NULL, partition_worker, &partition);
+    for (int t = 0; t < num_threads; t++) pthread_join(threads[t], NULL);
+    free(threads);
+    LOG(LOG_SUMMARY, "Cells solved in %.2f seconds\n", wall_time() - start);
+
+    Distances distances = {NULL, false, instance->points, instance->distance, n};
+    stitch_cells(&distances, &partition);
+    int dist = calculate_tour_length(partition.tour, n, &distances);
+    LOG(LOG_SUMMARY, "Stitched distance: %d\n", dist);
+
+    int* cell_of = malloc(n * sizeof(int));
+    for (int c = 0; c < partition.num_cells; c++) {
+        for (int i = cell_start(&partition, c); i < cell_start(&partition, c + 1); i++) cell_of[partition.tour[i]] = c;
+    }
+    KdTree tree;
+    build_kd_tree(&tree, instance);
+    Neighbor* best = malloc((k + 1) * sizeof(Neighbor));
+    TourState state;
+    init_tour_state(&state, partition.tour, n);
+    state.budget = budget;
+    CandidateList* candidates = &partition.candidates;
+    int queried = 0;
+    for (int i = 0; i < n; i++) {
+        int* row = &candidates->nodes[(size_t)i * k];
+        if (row[k - 1] >= 0 && !near_other_cell(&partition, cell_of, i, candidates->distances[(size_t)i * k + k - 1])) continue;
+        int count = 0;
+        kd_search(&tree, 0, NULL, NULL, i, k, best, &count);
+        queried++;
+        for (int p = 0; p < k; p++) {
+            row[p] = best[p].node;
+            candidates->distances[(size_t)i * k + p] = best[p].distance;
+        }
+        for (int p = 0; p < k; p++) {
+            if (cell_of[row[p]] != cell_of[i]) {
+                push_node(&state, i);
+                break;
+            }
+        }
+    }
+    free(best);
+    free_kd_tree(&tree);
+    LOG(LOG_SUMMARY, "Border nodes: %d (%d checked with the k-d tree)\n", state.queue_size, queried);
+    int (*local_search)(const Distances*, const CandidateList*, TourState*) = USE_LIN_KERNIGHAN ? lk_local : or2opt_local;
+    dist += local_search(&distances, candidates, &state);
+    tour_to_array(&state.tour, partition.tour);
+    LOG(LOG_SUMMARY, "Border refinement: %d in %.2f seconds\n", dist, wall_time() - start);
+
+    free_tour_state(&state);
+    free(cell_of);
+    free_candidates(candidates);
+    free(partition.box_lo);
+    free(partition.box_hi);
+    free((int*)partition.order);
+    TourResult result = {partition.tour, dist};
+    return result;
+}
+
+// Stops early once TIME_LIMIT seconds have passed or a tour of at most
+// target_dist (when positive) is found, and returns the best tour so far.
+// With TARGET_GAP, tours within that gap of the lower bound count as well.
+// start_tour, in file order, replaces the nearest neighbor tour of the first
+// run when not NULL.
+TourResult solve_tsp(const Instance* instance, int target_dist, const int* start_tour) {
+    double start = wall_time();
+    int num_points = instance->n;
+    int num_threads = NUM_THREADS > 0 ? NUM_THREADS : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1) num_threads = 1;
+    STATS_PHASE(PHASE_PREPROCESS);
+    Prepared prep;
+    // Partitioned instances get their candidate lists cell by cell, see partition_tsp.
+    if (PARTITION_CELL_NODES > 0 && num_points > PARTITION_CELL_NODES && instance->planar && !start_tour) {
+        renumber_instance(instance, &prep);
+        STATS_SWITCH_PHASE(PHASE_OTHER);
+        Budget budget = {.deadline = TIME_LIMIT > 0 ? start + TIME_LIMIT : 0};
+        TourResult result = partition_tsp(&prep, num_threads, &budget);
+        LOG(LOG_SUMMARY, "Total time: %.2f seconds\n", wall_time() - start);
+        STATS_SWITCH_PHASE(PHASE_IO);
+        update_tour_file(result.tour, prep.original_id, num_points, result.dist, wall_time() - start, create_tour_file());
+        STATS_END_PHASE();
+        if (prep.original_id) {
+            for (int i = 0; i < num_points; i++) result.tour[i] = prep.original_id[result.tour[i]];
+        }
+        free_prepared(&prep);
+        return result;
+    }
+    bool cached = USE_CACHE && load_cache(FILEPATH ".cache", FILEPATH, instance, &prep);
+    if (!cached) renumber_instance(instance, &prep);
+
+    KdTree tree;
+    if (prep.work.planar) build_kd_tree(&tree, &prep.work);
+    if (cached) {
+        LOG(LOG_SUMMARY, "Loaded cache %s\n", FILEPATH ".cache");
+    } else {
+        prep.distances = pre_process(&prep.work, prep.work.planar ? &tree : NULL, &prep.candidates, num_threads);
+        STATS_SWITCH_PHASE(PHASE_IO);
+        if (USE_CACHE) save_cache(FILEPATH ".cache", FILEPATH, instance, &prep);
+    }
+    STATS_END_PHASE();
+    LOG(LOG_SUMMARY, "Pre-processing time: %.3f seconds\n", wall_time() - start);
+    if (!prep.distances.triangle) LOG(LOG_SUMMARY, "Large instance: computing distances from coordinates\n");
+
+    int lower_bound = 0;
+    CandidateList alpha = {NULL, NULL, 0};
+    if (USE_LOWER_BOUND && prep.distances.triangle && num_points >= 3) {
+        double bound_start = wall_time();
+        STATS_SWITCH_PHASE(PHASE_PREPROCESS);
+        OneTree bound_tree;
+        init_one_tree(&bound_tree, &prep.candidates, num_points);
+        lower_bound = held_karp_bound(&prep.distances, &bound_tree, nearest_neighbor_length(&prep.distances));
+        if (ALPHA_CANDIDATES) alpha_candidates(&prep.distances, &bound_tree, &alpha);
+        free_one_tree(&bound_tree);
+        STATS_END_PHASE();
+        LOG(LOG_SUMMARY, "Lower bound: %d in %.2f seconds\n", lower_bound, wall_time() - bound_start);
+    } else if (USE_LOWER_BOUND) {
+        LOG(LOG_SUMMARY, "Lower bound: skipped, it needs the distance matrix\n");
+    }
+    if (TARGET_GAP > 0 && lower_bound > 0) {
+        int gap_target = (int)(lower_bound * (1 + TARGET_GAP / 100.0));
+        if (gap_target > target_dist) target_dist = gap_target;
+    }
+
+    int* warm_tour = NULL;
+    if (start_tour) {
+        warm_tour = malloc(num_points * sizeof(int));
+        for (int i = 0; i < num_points; i++) warm_tour[i] = prep.renumbered ? prep.renumbered[start_tour[i]] : start_tour[i];
+        LOG(LOG_SUMMARY, "Start tour: %d\n", calculate_tour_length(warm_tour, num_points, &prep.distances));
+    }
+
+    CheckpointHeader checkpoint;
+    int* resumed = RESUME ? load_checkpoint(num_points, &checkpoint) : NULL;
+    int resume_run = resumed ? (checkpoint.next_run < MAX_RUNS ? checkpoint.next_run : MAX_RUNS) : 0;
+
+    if (num_threads > MAX_RUNS - resume_run) num_threads = MAX_RUNS - resume_run > 0 ? MAX_RUNS - resume_run : 1;
+    LOG(LOG_SUMMARY, "Threads: %d\n", num_threads);
+
+    MultiStart ms = {
+        .distances = &prep.distances,
+        .candidates = &prep.candidates,
+        .search_candidates = alpha.nodes ? &alpha : &prep.candidates,
+        .start_tour = warm_tour,
+        .lower_bound = lower_bound,
+        .tree = prep.work.planar ? &tree : NULL,
+        .original_id = prep.original_id,
+        .renumbered = prep.renumbered,
+        .num_points = num_points,
+        .first_point = 1 + resume_run,
+        .num_runs = MAX_RUNS - resume_run,
+        .next_run = resume_run,
+        .num_threads = num_threads,
+        .tourfile_number = create_tour_file(),
+        .start = start,
+        .budget = {.deadline = TIME_LIMIT > 0 ? start + TIME_LIMIT : 0, .target_dist = target_dist},
+        .stop = false,
+        .abandon_above = INT_MAX,
+        .batch = calloc(num_threads, sizeof(TourResult)),
+        .arenas = malloc(num_threads * sizeof(RunArena)),
+        .best_tour = malloc(num_points * sizeof(int)), // swapped with run results, see RunArena
+        .shortest_dist = INT_MAX,
+        .saved_dist = INT_MAX,
+    };
+    atomic_init(&ms.incumbent, INT_MAX);
+    start_writer(&ms.writer, prep.original_id, num_points, ms.tourfile_number);
+    if (resumed) {
+        for (int i = 0; i < num_points; i++) ms.best_tour[i] = prep.renumbered ? prep.renumbered[resumed[i]] : resumed[i];
+        ms.shortest_dist = ms.saved_dist = calculate_tour_length(ms.best_tour, num_points, &prep.distances);
+        atomic_store(&ms.incumbent, ms.shortest_dist);
+        submit_tour(&ms.writer, ms.best_tour, ms.shortest_dist, resume_run, 0);
+        LOG(LOG_SUMMARY, "Resuming at run %d from %d\n", resume_run, ms.shortest_dist);
+        free(resumed);
+    }
+    if (USE_TOUR_MERGING) init_tour_merge(&ms.merge, num_points);
+    ms.budget.incumbent = &ms.incumbent;
+    pthread_barrier_init(&ms.barrier, NULL, num_threads);
+
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    Worker* workers = malloc(num_threads * sizeof(Worker));
+    for (int t = 0; t < num_threads; t++) {
+        workers[t].shared = &ms;
+        workers[t].id = t;
+        pthread_create(&threads[t], NULL, multi_start_worker, &workers[t]);
+    }
+    for (int t = 0; t < num_threads; t++) pthread_join(threads[t], NULL);
+    stop_writer(&ms.writer);
+
+    LOG(LOG_SUMMARY, "Total time: %.2f seconds\n", wall_time() - start);
+    if (lower_bound > 0) LOG(LOG_SUMMARY, "Lower bound: %d, gap %.3f%%\n", lower_bound, 100.0 * (ms.shortest_dist - lower_bound) / lower_bound);
+
+    pthread_barrier_destroy(&ms.barrier);
+    free(threads);
+    free(workers);
+    free(ms.batch);
+    free(ms.arenas);
+    if (USE_TOUR_MERGING) free_tour_merge(&ms.merge);
+    if (alpha.nodes) free_candidates(&alpha);
+    free(warm_tour);
+    if (prep.work.planar) free_kd_tree(&tree);
+    if (prep.original_id) {
+        for (int i = 0; i < num_points; i++) ms.best_tour[i] = prep.original_id[ms.best_tour[i]];
+    }
+    free_prepared(&prep);
+    TourResult result = {ms.best_tour, ms.shortest_dist};
+    return result;
+}
+
+int main() {
+    setvbuf(stdout, NULL, _IOFBF, LOG_BUFFER);
+    double parse_start = wall_time();
+    STATS_START_THREAD("main", PHASE_OTHER);
+    STATS_PHASE(PHASE_PARSE);
+    Instance instance;
+    if (!parse_tsp_file(FILEPATH, &instance)) {
         printf("Failed to parse TSP file %s\n", FILEPATH);
         return 1;
     }
+    LOG(LOG_SUMMARY, "Parsed %d nodes in %.3f seconds\n", instance.n, wall_time() - parse_start);
+    int num_points = instance.n;
     int opt_num_points;
     int* opt_tour = parse_tour_file(OPT_FILEPATH, &opt_num_points);
     int opt_dist = 0;
     if (opt_tour != NULL) {
-        opt_dist = calculate_tour_distance(tsp_points, opt_tour, num_points);
+        opt_dist = calculate_tour_distance(&instance, opt_tour, num_points);
     }
-    printf("Optimal distance: %d\n", opt_dist);
+    LOG(LOG_SUMMARY, "Optimal distance: %d\n", opt_dist);
 
-    TourResult result = solve_tsp(tsp_points, num_points);
+    int target_dist = TARGET_DIST != 0 ? TARGET_DIST : opt_dist;
+    int* start_tour = load_start_tour(START_FILEPATH, num_points);
+    STATS_END_PHASE();
+    TourResult result = solve_tsp(&instance, target_dist, start_tour);
     int* tour = result.tour;
     int dist = result.dist;
 
-    printf("Optimal distance: %d\n", opt_dist);
-    printf("Best found distance: %d\n", dist);
+    LOG(LOG_SUMMARY, "Optimal distance: %d\n", opt_dist);
+    LOG(LOG_SUMMARY, "Best found distance: %d\n", dist);
+#if INSTRUMENT
+    save_stats(num_points, dist, wall_time() - parse_start);
+#endif
 
     free(tour);
     free(opt_tour);
-    free(tsp_points);
+    free(start_tour);
+    free_instance(&instance);
     return 0;
 }